@@ -63,6 +63,29 @@ tree doesn't have cyclic references.
 #define JSON_DOUBLE_MAX_DECIMALS 15
 #endif
 
+// Largest scale, either way, of a JT_DECIMAL value
+#ifndef JSON_DECIMAL_MAX_SCALE
+#define JSON_DECIMAL_MAX_SCALE 308
+#endif
+
+// Smallest string JSON_EncodeObjectToIOVec references in place instead of copying, default for encoder
+#ifndef JSON_IOVEC_MIN_REFERENCE
+#define JSON_IOVEC_MIN_REFERENCE 4096
+#endif
+
+// Largest buffer segment JSON_EncodeObjectToIOVec allocates, unless a single value needs more
+#ifndef JSON_IOVEC_MAX_SEGMENT
+#define JSON_IOVEC_MAX_SEGMENT 1048576
+#endif
+
+// Output bytes per item reserved up front for containers with a size hint, and the most reserved for one container
+#ifndef JSON_SIZE_HINT_ITEM_BYTES
+#define JSON_SIZE_HINT_ITEM_BYTES 16
+#endif
+#ifndef JSON_SIZE_HINT_MAX_RESERVE
+#define JSON_SIZE_HINT_MAX_RESERVE 1048576
+#endif
+
 // Max recursion depth, default for encoder
 #ifndef JSON_MAX_RECURSION_DEPTH
 #define JSON_MAX_RECURSION_DEPTH 1024
@@ -139,6 +162,8 @@ enum JSTYPES
 	JT_UTF8,        //(char 8-bit)
 	JT_ARRAY,       // Array structure
 	JT_OBJECT,		// Key/Value structure 
+	JT_RAW,			// Already encoded JSON (char 8-bit), copied to the output as is
+	JT_DECIMAL,		// Fixed point decimal (JSINT64 mantissa * 10^-scale), written exactly
 	JT_INVALID,		// Internal, do not return nor expect
 };
 
@@ -149,8 +174,28 @@ typedef struct __JSONTypeContext
 {
 	int type;
 	void *prv;
+	/* The encoder configuration this context belongs to, set before beginTypeContext is called */
+	const struct __JSONObjectEncoder *encoder;
 } JSONTypeContext;
 
+/*
+A scalar as handed to the encoder by getValue. Which field is used depends on the type set in the type context:
+longValue for JT_LONG and JT_INT, doubleValue for JT_DOUBLE, stringValue/cbString for JT_UTF8 and JT_RAW
+and longValue/scale for JT_DECIMAL */
+typedef struct __JSONValue
+{
+	JSINT64 longValue;
+	double doubleValue;
+	const char *stringValue;
+	size_t cbString;
+
+	/* Digits after the decimal point of a JT_DECIMAL, negative to multiply by a power of ten instead */
+	int scale;
+
+	/* Set to nonzero if endTypeContext must be called once a scalar has been written, containers are always ended */
+	int endContext;
+} JSONValue;
+
 /*
 Function pointer declarations, suitable for implementing UltraJSON */
 typedef void (*JSPFN_ITERBEGIN)(JSOBJ obj, JSONTypeContext *tc);
@@ -158,9 +203,96 @@ typedef int (*JSPFN_ITERNEXT)(JSOBJ obj, JSONTypeContext *tc);
 typedef void (*JSPFN_ITEREND)(JSOBJ obj, JSONTypeContext *tc);
 typedef JSOBJ (*JSPFN_ITERGETVALUE)(JSOBJ obj, JSONTypeContext *tc);
 typedef char *(*JSPFN_ITERGETNAME)(JSOBJ obj, JSONTypeContext *tc, size_t *outLen);
+typedef int (*JSPFN_ITERGETBULK)(JSOBJ obj, JSONTypeContext *tc, const void **outValues, size_t *outCount);
+typedef size_t (*JSPFN_ITERSIZEHINT)(JSOBJ obj, JSONTypeContext *tc);
+typedef int (*JSPFN_HOLDSTRING)(JSOBJ obj, JSONTypeContext *tc);
+typedef void (*JSPFN_GETVALUE)(JSOBJ obj, JSONTypeContext *tc, JSONValue *value);
+typedef int (*JSPFN_MEMOIZE)(JSOBJ obj, JSONTypeContext *tc);
 typedef void *(*JSPFN_MALLOC)(size_t size);
 typedef void (*JSPFN_FREE)(void *pptr);
 typedef void *(*JSPFN_REALLOC)(void *base, size_t size);
+typedef size_t (*JSPFN_WRITE)(void *context, const char *buffer, size_t cbBuffer);
+
+struct __JSONKeyCache;
+struct __JSONMemo;
+
+/*
+One piece of output of JSON_EncodeObjectToIOVec.
+Laid out like struct iovec so the segments can be handed to writev as is */
+typedef struct __JSONSegment
+{
+	const void *base;
+	size_t length;
+} JSONSegment;
+
+typedef struct __JSONIOVec
+{
+	/* Output, concatenated in order the segments form the JSON document */
+	JSONSegment *segments;
+	size_t count;
+
+	/* Private to the encoder. Output that fits one segment uses firstSegment, the JSONIOVec
+	mustn't be copied or moved until JSON_FreeIOVec then */
+	JSONSegment firstSegment;
+	size_t capacity;
+	size_t minReference;
+	size_t cbAssigned;
+	char **buffers;
+	size_t bufferCount;
+	size_t bufferCapacity;
+	JSOBJ *held;
+	size_t heldCount;
+	size_t heldCapacity;
+} JSONIOVec;
+
+/*
+State of a streaming XXH64 hash, see JSON_HashInit */
+typedef struct __JSONHash
+{
+	JSUINT64 total;
+	JSUINT64 seed;
+	JSUINT64 v1;
+	JSUINT64 v2;
+	JSUINT64 v3;
+	JSUINT64 v4;
+	unsigned char pending[32];
+	size_t cbPending;
+} JSONHash;
+
+/*
+Kinds of holes in a JSONTemplate and the bind function that fills each */
+enum JSTEMPLATEHOLES
+{
+	JTH_END,		// Internal, marks the literal after the last hole
+	JTH_LONG,		// <int> JSON_TemplateBindLong
+	JTH_DOUBLE,		// <double> JSON_TemplateBindDouble
+	JTH_UTF8,		// <str> JSON_TemplateBindString, escaped and quoted
+	JTH_RAW,		// <raw> JSON_TemplateBindRaw, already encoded JSON copied as is
+	JTH_OBJECT,		// <value> JSON_TemplateBindObject, encoded like JSON_EncodeObject would
+};
+
+typedef struct __JSONTemplateChunk
+{
+	/* Constant output written before the hole */
+	const char *literal;
+	size_t cbLiteral;
+	int hole;
+} JSONTemplateChunk;
+
+/*
+A JSON skeleton with typed holes, see JSON_CompileTemplate */
+typedef struct __JSONTemplate
+{
+	/* holeCount + 1 chunks, the last one holds the literal after the last hole and JTH_END */
+	JSONTemplateChunk *chunks;
+	size_t holeCount;
+
+	/* Total length of all literals */
+	size_t cbLiterals;
+
+	/* Private to the encoder */
+	char *text;
+} JSONTemplate;
 
 typedef struct __JSONObjectEncoder
 {
@@ -214,7 +346,8 @@ typedef struct __JSONObjectEncoder
 	JSPFN_FREE free;
 
 	/*
-	Configuration for max recursion, set to 0 to use default (see JSON_MAX_RECURSION_DEPTH)*/
+	Configuration for max recursion, set to 0 to use default (see JSON_MAX_RECURSION_DEPTH)
+	Nesting is tracked on an explicit stack rather than the C stack so this can safely be raised well above the default */
 	int recursionMax;
 
 	/*
@@ -225,12 +358,110 @@ typedef struct __JSONObjectEncoder
 	If true output will be ASCII with all characters above 127 encoded as \uXXXX. If false output will be UTF-8 or what ever charset strings are brought as */
 	int forceASCII;
 
+	/*
+	Set to an error message if error occured, only by the functions taking a non const encoder */
+	const char *errorMsg;
+	JSOBJ errorObj;
+
+	/*
+	Fields added since are appended below, so positional initializers of the fields above keep working */
+
+	/*
+	If true doubles are encoded with a short representation that parses back to the exact same value and doublePrecision is ignored.
+	This is Grisu2, which is occasionally (about 0.1% of values) one digit longer than the shortest one */
+	int doubleShortest;
+
+	/*
+	Optional, may be NULL. Called after iterBegin of a JT_ARRAY to hand over all elements at once as a contiguous span.
+	Return JT_LONG with outValues pointing to JSINT64 values or JT_DOUBLE with outValues pointing to double values and outCount
+	set to the number of elements. Return JT_INVALID to have the array iterated element by element as usual.
+	The span must stay valid until iterEnd is called
+	*/
+	JSPFN_ITERGETBULK iterGetBulk;
+
+	/*
+	Optional, may be NULL. Used by JSON_EncodeObjectToIOVec for large strings that need no escaping.
+	Return nonzero to keep the bytes returned by getStringValue valid until JSON_FreeIOVec so they can be
+	referenced in place instead of copied. obj is handed to releaseObject by JSON_FreeIOVec.
+	*/
+	JSPFN_HOLDSTRING holdString;
+
+	/*
+	If true iterNext is expected to return the members of a JT_OBJECT ordered byte-wise by their UTF-8 names.
+	The encoder doesn't reorder anything itself, type contexts read this through tc->encoder */
+	int sortKeys;
+
+	/*
+	If true numbers are written in a normalized form so that equal values always give the same bytes.
+	Doubles holding an integral value below 2^53 are written like integers (-0.0 as 0) and all other
+	doubles in their short round trip form (see doubleShortest), doublePrecision and doubleShortest are ignored.
+	Decimals lose their trailing zeros and are written out in full, as d.ddde+N past JSON_DECIMAL_MAX_SCALE zeros */
+	int canonical;
+
+	/*
+	Optional, may be NULL. Does the work of beginTypeContext and the matching get*Value call in one go: sets tc->type and,
+	for scalars, fills value. Scalars that need no cleanup leave value->endContext zero so endTypeContext is skipped.
+	JT_ARRAY and JT_OBJECT are set up as by beginTypeContext. When NULL the encoder adapts the separate callbacks.
+	beginTypeContext is still required, JSON_EncodeObjectParallel uses it for the top level container
+	*/
+	JSPFN_GETVALUE getValue;
+
+	/*
+	Optional, may be NULL to disable memoization. Called when a JT_ARRAY or JT_OBJECT is begun. Return nonzero if obj always
+	encodes to the same output within one encode call and may be recognized by its identity, its output is then recorded and
+	copied whenever obj shows up again. obj must be kept alive, it's handed to releaseObject once the encode call is done
+	*/
+	JSPFN_MEMOIZE memoize;
+
+	/*
+	Optional, may be NULL. Called before iterBegin to get the number of items in a JT_ARRAY or JT_OBJECT, return 0 if unknown.
+	The encoder uses it to make room for the whole container at once instead of growing the output piecemeal
+	*/
+	JSPFN_ITERSIZEHINT iterSizeHint;
+
+	/*
+	If set, every byte of output is fed to this hash while encoding, in small pieces while they are
+	still in cache, so a digest of the output (eg. for an ETag) needs no second pass over it.
+	Initialize with JSON_HashInit and read with JSON_HashDigest once encoding is done.
+	Only used by the functions taking a non const encoder, see JSONEncodeState.hash */
+	JSONHash *hash;
+
+	/*
+	Optional, may be NULL unless beginTypeContext sets JT_DECIMAL. Returns the mantissa of the decimal and stores its
+	scale in outScale, the value is mantissa * 10^-scale (eg. 1.50 is 150 with a scale of 2). Decimals are written with
+	integer arithmetic only, exactly as given including trailing zeros, the scale may be at most JSON_DECIMAL_MAX_SCALE
+	either way. getValue fills JSONValue.longValue and scale instead
+	*/
+	JSINT64 (*getDecimalValue)(JSOBJ obj, JSONTypeContext *tc, int *outScale);
+} JSONObjectEncoder;
+
+/*
+Everything an encode changes while it runs. A JSONObjectEncoder only configures encoding, it isn't
+written to by the functions taking it as const. So one configured encoder can be shared by any
+number of threads, each encoding with its own JSONEncodeState, without copying or locking.
+The functions taking a non const encoder are wrappers which use a state of their own */
+typedef struct __JSONEncodeState
+{
+	/*
+	Set by caller before the call, NULL or a hash initialized with JSON_HashInit to feed all output to.
+	Zero initializing the whole state is fine */
+	JSONHash *hash;
 
 	/*
 	Set to an error message if error occured */
 	const char *errorMsg;
 	JSOBJ errorObj;
 
+	/* Private to the encoder */
+	const struct __JSONObjectEncoder *encoder;
+
+	/* The encoder's allocator and limits with defaults filled in */
+	JSPFN_MALLOC malloc;
+	JSPFN_REALLOC realloc;
+	JSPFN_FREE free;
+	int recursionMax;
+	int doublePrecision;
+
 	/* Buffer stuff */
 	char *start;
 	char *offset;
@@ -238,7 +469,27 @@ typedef struct __JSONObjectEncoder
 	int heap;
 	int level;
 
-} JSONObjectEncoder;
+	/* Output stream, set by JSON_EncodeObjectToStream */
+	JSPFN_WRITE write;
+	void *writeContext;
+
+	/* Cache of already escaped object keys, allocated once an encode has seen enough keys */
+	struct __JSONKeyCache *keyCache;
+	int keyCount;
+
+	/* Output of containers seen so far by identity, allocated once memoize accepts one */
+	struct __JSONMemo *memo;
+
+	/* Segment list, set by JSON_EncodeObjectToIOVec */
+	JSONIOVec *iovec;
+
+	/* Output up to here has been fed to hash */
+	char *hashed;
+
+	/* Template being filled and the next hole to bind, set by JSON_TemplateBegin */
+	const JSONTemplate *tmpl;
+	size_t tmplHole;
+} JSONEncodeState;
 
 
 /*
@@ -262,6 +513,205 @@ JSONObjectEncoder.free or free() as specified when calling this function.
 */
 EXPORTFUNCTION char *JSON_EncodeObject(JSOBJ obj, JSONObjectEncoder *enc, char *buffer, size_t cbBuffer);
 
+/*
+The functions below work like those without WithState except that enc is only read and everything that
+changes during the call (including errorMsg) lives in es, see JSONEncodeState. Safe to call from
+several threads at once with the same enc as long as each uses its own es and the callbacks are thread safe */
+EXPORTFUNCTION char *JSON_EncodeObjectWithState(JSOBJ obj, const JSONObjectEncoder *enc, JSONEncodeState *es, char *buffer, size_t cbBuffer);
+EXPORTFUNCTION int JSON_EncodeObjectToStreamWithState(JSOBJ obj, const JSONObjectEncoder *enc, JSONEncodeState *es, JSPFN_WRITE write, void *writeContext, char *buffer, size_t cbBuffer);
+EXPORTFUNCTION char *JSON_EncodeBatchWithState(JSOBJ *objs, size_t n, const JSONObjectEncoder *enc, JSONEncodeState *es, const char *separator, size_t cbSeparator, size_t *offsets, char *buffer, size_t cbBuffer);
+EXPORTFUNCTION int JSON_EncodeObjectToIOVecWithState(JSOBJ obj, const JSONObjectEncoder *enc, JSONEncodeState *es, size_t minReference, JSONIOVec *iovec, char *buffer, size_t cbBuffer);
+
+/*
+Encode an object structure into JSON and hand the output to a write function chunk by chunk.
+Whenever the working buffer fills up its contents are written out and the buffer is reused,
+so memory use is bounded by the buffer size rather than the size of the document.
+
+Arguments:
+obj - An anonymous type representing the object
+enc - Function definitions for querying JSOBJ type
+write - Called with each chunk of output. Must return the number of bytes written, anything less than cbBuffer is treated as an error
+writeContext - Passed as is to write
+buffer - Working buffer. If NULL function allocates own buffer
+cbBuffer - Length of buffer (ignored if buffer is NULL)
+
+Returns:
+TRUE on success, FALSE on error with errorMsg set. Output isn't null terminated.
+
+NOTE:
+The working buffer still grows if a single value doesn't fit in it.
+On error the output written so far is incomplete.
+*/
+EXPORTFUNCTION int JSON_EncodeObjectToStream(JSOBJ obj, JSONObjectEncoder *enc, JSPFN_WRITE write, void *writeContext, char *buffer, size_t cbBuffer);
+
+#ifdef JSON_WITH_ZLIB
+/*
+Encode an object structure into JSON compressed with zlib's deflate, only available when built with JSON_WITH_ZLIB.
+Works like JSON_EncodeObjectToStream except each chunk of output is compressed before it's written,
+so neither the whole JSON nor the whole compressed output is ever held in memory.
+
+Arguments:
+obj - An anonymous type representing the object
+enc - Function definitions for querying JSOBJ type
+level - Compression level 0-9 or Z_DEFAULT_COMPRESSION
+windowBits - As for deflateInit2, 15 for zlib format, 31 (15 + 16) for gzip or -15 for raw deflate
+write - Called with each chunk of compressed output, see JSON_EncodeObjectToStream
+writeContext - Passed as is to write
+buffer - Working buffer. If NULL function allocates own buffer
+cbBuffer - Length of buffer (ignored if buffer is NULL)
+
+Returns:
+TRUE on success, FALSE on error with errorMsg set.
+*/
+EXPORTFUNCTION int JSON_EncodeObjectToDeflate(JSOBJ obj, JSONObjectEncoder *enc, int level, int windowBits, JSPFN_WRITE write, void *writeContext, char *buffer, size_t cbBuffer);
+#endif
+
+/*
+Encode a batch of object structures into one buffer, one document after the other.
+Encoder setup, the output buffer and the object key cache are shared by all documents
+which makes this considerably cheaper than calling JSON_EncodeObject for each.
+
+Arguments:
+objs - Array of n objects to encode
+n - Number of objects
+enc - Function definitions for querying JSOBJ type
+separator - Written after each document, eg. "\n" for newline delimited JSON. May be NULL if cbSeparator is 0
+cbSeparator - Length of separator
+offsets - Array of n + 1 entries. On return offsets[i] is the position of document i in the output
+          and offsets[n] the total length of the output. Document i spans offsets[i] to offsets[i + 1] - cbSeparator
+buffer - Preallocated buffer to store result in. If NULL function allocates own buffer
+cbBuffer - Length of buffer (ignored if buffer is NULL)
+
+Returns:
+All documents as a null terminated char string or NULL on error with errorMsg set.
+
+NOTE:
+Memory of the returned buffer is handled as with JSON_EncodeObject.
+*/
+EXPORTFUNCTION char *JSON_EncodeBatch(JSOBJ *objs, size_t n, JSONObjectEncoder *enc, const char *separator, size_t cbSeparator, size_t *offsets, char *buffer, size_t cbBuffer);
+
+/*
+Encode an object structure into JSON as a list of segments rather than one buffer.
+Strings of at least minReference bytes that need no escaping are not copied, their segment
+points at the bytes returned by getStringValue (requires holdString). Everything else is
+encoded into a chain of buffers which the remaining segments point into. A full buffer is never
+moved or copied, encoding continues in a new one of twice the size (up to JSON_IOVEC_MAX_SEGMENT),
+so output of any size is written exactly once and can be gathered into an exact sized result.
+
+Arguments:
+obj - An anonymous type representing the object
+enc - Function definitions for querying JSOBJ type
+minReference - Smallest string to reference in place, 0 for the default (see JSON_IOVEC_MIN_REFERENCE)
+iovec - Receives the segments
+buffer - Preallocated buffer to store result in. If NULL function allocates own buffer
+cbBuffer - Length of buffer (ignored if buffer is NULL)
+
+Returns:
+TRUE on success, FALSE on error with errorMsg set. The output isn't null terminated.
+
+NOTE:
+On success the segments must be released with JSON_FreeIOVec once written out, using the same encoder.
+Note that '/' is always escaped so eg. base64 data containing it is copied.
+*/
+EXPORTFUNCTION int JSON_EncodeObjectToIOVec(JSOBJ obj, JSONObjectEncoder *enc, size_t minReference, JSONIOVec *iovec, char *buffer, size_t cbBuffer);
+
+/*
+Releases the segment list, the buffer and every string held by JSON_EncodeObjectToIOVec */
+EXPORTFUNCTION void JSON_FreeIOVec(const JSONObjectEncoder *enc, JSONIOVec *iovec);
+
+/*
+Encode an object structure into JSON using several threads.
+The items of a top level JT_ARRAY or JT_OBJECT are split into one range per thread, each range is
+encoded with its own JSONEncodeState into its own buffer and the results are joined in order.
+Anything else is encoded with JSON_EncodeObject.
+
+Arguments:
+obj - An anonymous type representing the object
+enc - Function definitions for querying JSOBJ type
+threads - Number of threads to use including the calling one, 0 for one per online processor
+buffer - Preallocated buffer to store result in. If NULL function allocates own buffer
+cbBuffer - Length of buffer (ignored if buffer is NULL)
+
+Returns:
+Encoded JSON object as a null terminated char string, memory is handled as with JSON_EncodeObject.
+NULL on error with errorMsg set.
+
+NOTE:
+All callbacks are invoked concurrently from several threads and must be thread safe, enc itself is shared
+by the threads as is, each encodes with a JSONEncodeState of its own. Values and names
+returned for the items of the top level container must stay valid until its iterEnd is called.
+Define JSON_NO_THREADS to build without thread support, all ranges are then encoded by the calling thread.
+*/
+EXPORTFUNCTION char *JSON_EncodeObjectParallel(JSOBJ obj, JSONObjectEncoder *enc, int threads, char *buffer, size_t cbBuffer);
+EXPORTFUNCTION char *JSON_EncodeObjectParallelWithState(JSOBJ obj, const JSONObjectEncoder *enc, JSONEncodeState *es, int threads, char *buffer, size_t cbBuffer);
+
+/*
+Streaming XXH64, the hash fed by the encoder when JSONObjectEncoder.hash is set. Digests match
+those of the reference xxHash implementation for the same seed and input */
+EXPORTFUNCTION void JSON_HashInit(JSONHash *hash, JSUINT64 seed);
+EXPORTFUNCTION void JSON_HashUpdate(JSONHash *hash, const void *data, size_t cbData);
+EXPORTFUNCTION JSUINT64 JSON_HashDigest(const JSONHash *hash);
+
+
+/*
+Compile a template, a JSON skeleton in which holes like <int> stand for values supplied later.
+Holes are <int>, <double>, <str>, <raw> and <value> (see JSTEMPLATEHOLES) and are only recognized outside
+of strings. Everything else is constant output and copied as is, so it must already be valid, escaped JSON.
+
+Arguments:
+enc - Encoder whose malloc and free are used
+tmpl - Receives the template, release it with JSON_FreeTemplate
+text - The skeleton, eg. {"status":"ok","id":<int>,"items":<raw>}
+cbText - Length of text
+
+Returns:
+TRUE on success, FALSE on error with errorMsg set.
+*/
+EXPORTFUNCTION int JSON_CompileTemplate(JSONObjectEncoder *enc, JSONTemplate *tmpl, const char *text, size_t cbText);
+EXPORTFUNCTION void JSON_FreeTemplate(const JSONObjectEncoder *enc, JSONTemplate *tmpl);
+
+/*
+Fill a template. JSON_TemplateBegin writes the literal up to the first hole, every bind writes a value
+followed by the literal up to the next hole, so most of the output is a memcpy of constant chunks.
+Values must be bound in order and with the bind function matching each hole's type.
+Like the WithState functions a template can be filled by several threads at once, each with its own es.
+
+Arguments:
+enc - Function definitions, used by JSON_TemplateBindObject and for options like forceASCII
+es - State of this fill, passed to every bind and JSON_TemplateEnd
+tmpl - The compiled template, must stay valid until JSON_TemplateEnd
+buffer - Preallocated buffer to store result in. If NULL function allocates own buffer
+cbBuffer - Length of buffer (ignored if buffer is NULL)
+cbOutput - If not NULL receives the length of the output of JSON_TemplateEnd
+
+Returns:
+The binds return TRUE on success, FALSE on error with errorMsg set after which further binds do nothing.
+JSON_TemplateEnd returns the output as a null terminated char string, memory is handled as with
+JSON_EncodeObject, or NULL on error or if not every hole was bound.
+*/
+EXPORTFUNCTION int JSON_TemplateBegin(const JSONObjectEncoder *enc, JSONEncodeState *es, const JSONTemplate *tmpl, char *buffer, size_t cbBuffer);
+EXPORTFUNCTION int JSON_TemplateBindLong(JSONEncodeState *es, JSINT64 value);
+EXPORTFUNCTION int JSON_TemplateBindDouble(JSONEncodeState *es, double value);
+EXPORTFUNCTION int JSON_TemplateBindString(JSONEncodeState *es, const char *value, size_t cbValue);
+EXPORTFUNCTION int JSON_TemplateBindRaw(JSONEncodeState *es, const char *value, size_t cbValue);
+EXPORTFUNCTION int JSON_TemplateBindObject(JSONEncodeState *es, JSOBJ obj);
+EXPORTFUNCTION char *JSON_TemplateEnd(JSONEncodeState *es, size_t *cbOutput);
+
+/*
+Optional process wide buffer pool. Set JSONObjectEncoder.malloc, realloc and free to these to have the
+encoder's working buffers (and the buffers it returns) reused across calls instead of coming fresh from
+malloc each time. Blocks between 4KB and 4MB are rounded up to a power of two size class. When freed they
+are kept in a small cache private to the freeing thread or in a few shared lock-free slots per class, and
+only released to free when those are full. Anything smaller or larger goes straight to malloc and free.
+
+Returned buffers must be released with JSON_PoolFree. At most 16 blocks per class stay in the shared slots,
+plus one block of each class up to 256KB per thread which is handed back to the shared slots when the
+thread exits. JSON_PoolTrim frees the shared blocks and the calling thread's, eg. after a burst of large
+outputs. Define JSON_NO_THREADS to build the pool without atomics and thread caches */
+EXPORTFUNCTION void *JSON_PoolMalloc(size_t size);
+EXPORTFUNCTION void *JSON_PoolRealloc(void *base, size_t size);
+EXPORTFUNCTION void JSON_PoolFree(void *base);
+EXPORTFUNCTION void JSON_PoolTrim(void);
 
 
 typedef struct __JSONObjectDecoder
@@ -44,6 +44,41 @@ http://www.opensource.apple.com/source/tcl/tcl-14/tcl/license.terms
 
 #include <float.h>
 
+/*
+Vector kernels used to skip over runs of bytes which can be copied to the output as is.
+Define JSON_NO_SIMD to build the plain scalar encoder */
+#ifndef JSON_NO_SIMD
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define JSON_SIMD_AVX2
+#define JSON_SIMD_WIDTH 32
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define JSON_SIMD_SSE2
+#define JSON_SIMD_WIDTH 16
+#elif (defined(__ARM_NEON) || defined(__ARM_NEON__)) && defined(__GNUC__)
+#include <arm_neon.h>
+#define JSON_SIMD_NEON
+#define JSON_SIMD_WIDTH 16
+#endif
+#endif
+
+#ifdef JSON_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+/*
+Worker threads used by JSON_EncodeObjectParallel.
+Define JSON_NO_THREADS to encode all ranges on the calling thread instead */
+#ifndef JSON_NO_THREADS
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#endif
+
 #ifndef TRUE
 #define TRUE 1
 #endif
@@ -51,8 +86,28 @@ http://www.opensource.apple.com/source/tcl/tcl-14/tcl/license.terms
 #define FALSE 0
 #endif
 
+/*
+Worst case number of output bytes per input byte when escaping a string, see encode() */
+#define JSON_MAX_ESCAPE_RATIO 6
+
 static const double g_pow10[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000, 10000000000, 100000000000, 1000000000000, 10000000000000, 100000000000000, 1000000000000000};
 static const char g_hexChars[] = "0123456789abcdef";
+static const char g_hexPairs[] =
+    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+    "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+    "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+    "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+    "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+    "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+    "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+    "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+static const char g_digitPairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
 static const char g_escapeChars[] = "0123456789\\b\\t\\n\\f\\r\\\"\\\\\\/";
 
 /*
@@ -60,7 +115,8 @@ FIXME: While this is fine dandy and working it's a magic value mess which probab
 Needs a cleanup and more documentation */
 
 /*
-Table for pure ascii output escaping all characters above 127 to \uXXXX */
+Table for pure ascii output escaping all characters above 127 to \uXXXX
+7 marks bytes which can never start a UTF-8 sequence (stray continuation bytes, 0xfe and 0xff) */
 static const JSUINT8 g_asciiOutputTable[256] = 
 {
 /* 0x00 */ 0, 30, 30, 30, 30, 30, 30, 30, 10, 12, 14, 30, 16, 18, 30, 30, 
@@ -71,94 +127,505 @@ static const JSUINT8 g_asciiOutputTable[256] =
 /* 0x50 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 22, 1, 1, 1,
 /* 0x60 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 
 /* 0x70 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-/* 0x80 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 
-/* 0x90 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-/* 0xa0 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 
-/* 0xb0 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+/* 0x80 */ 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 
+/* 0x90 */ 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+/* 0xa0 */ 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 
+/* 0xb0 */ 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
 /* 0xc0 */ 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 
 /* 0xd0 */ 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
 /* 0xe0 */ 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 
-/* 0xf0 */ 4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 1, 1
+/* 0xf0 */ 4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 7, 7
+};
+
+
+static void SetError (JSOBJ obj, JSONEncodeState *es, const char *message)
+{
+    es->errorMsg = message;
+    es->errorObj = obj;
+}
+
+/*
+Output of memoized containers keyed by object identity. Entries point at earlier output by its offset
+in the buffer. generation is bumped whenever earlier output stops being found at its offset (a stream
+flush, moving on to a new iovec buffer) or stops being contiguous (a referenced string), which
+invalidates everything recorded up to then. depth is how many levels the container nests below itself,
+the output is only reused where that stays within recursionMax */
+typedef struct __JSONMemoEntry
+{
+    JSOBJ obj;
+    size_t offset;
+    size_t length;
+    JSUINT32 generation;
+    int depth;
+} JSONMemoEntry;
+
+struct __JSONMemo
+{
+    JSONMemoEntry *entries;
+    size_t capacity;
+    size_t count;
+    JSUINT32 generation;
 };
 
+#define Memo_Invalidate(__enc) \
+    if ((__enc)->memo) \
+    { \
+        (__enc)->memo->generation ++; \
+    }
+
+/*
+Streaming XXH64, see https://github.com/Cyan4973/xxHash for the specification */
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define XXH_ROTL64(__x, __r) (((__x) << (__r)) | ((__x) >> (64 - (__r))))
+
+static FASTCALL_ATTR INLINE_PREFIX JSUINT64 FASTCALL_MSVC Hash_Read64 (const unsigned char *p)
+{
+    return (JSUINT64) p[0] | ((JSUINT64) p[1] << 8) | ((JSUINT64) p[2] << 16) | ((JSUINT64) p[3] << 24) |
+        ((JSUINT64) p[4] << 32) | ((JSUINT64) p[5] << 40) | ((JSUINT64) p[6] << 48) | ((JSUINT64) p[7] << 56);
+}
+
+static FASTCALL_ATTR INLINE_PREFIX JSUINT64 FASTCALL_MSVC Hash_Read32 (const unsigned char *p)
+{
+    return (JSUINT64) p[0] | ((JSUINT64) p[1] << 8) | ((JSUINT64) p[2] << 16) | ((JSUINT64) p[3] << 24);
+}
+
+static FASTCALL_ATTR INLINE_PREFIX JSUINT64 FASTCALL_MSVC Hash_Round (JSUINT64 acc, JSUINT64 input)
+{
+    acc += input * XXH_PRIME64_2;
+    acc = XXH_ROTL64 (acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static FASTCALL_ATTR INLINE_PREFIX JSUINT64 FASTCALL_MSVC Hash_MergeRound (JSUINT64 acc, JSUINT64 value)
+{
+    acc ^= Hash_Round (0, value);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/*
+Consumes whole 32 byte stripes from p and returns where it stopped */
+static const unsigned char *Hash_Stripes (JSONHash *hash, const unsigned char *p, const unsigned char *end)
+{
+    JSUINT64 v1 = hash->v1;
+    JSUINT64 v2 = hash->v2;
+    JSUINT64 v3 = hash->v3;
+    JSUINT64 v4 = hash->v4;
+
+    while (end - p >= 32)
+    {
+        v1 = Hash_Round (v1, Hash_Read64 (p));
+        v2 = Hash_Round (v2, Hash_Read64 (p + 8));
+        v3 = Hash_Round (v3, Hash_Read64 (p + 16));
+        v4 = Hash_Round (v4, Hash_Read64 (p + 24));
+        p += 32;
+    }
+
+    hash->v1 = v1;
+    hash->v2 = v2;
+    hash->v3 = v3;
+    hash->v4 = v4;
+    return p;
+}
+
+void JSON_HashInit (JSONHash *hash, JSUINT64 seed)
+{
+    memset (hash, 0, sizeof (JSONHash));
+    hash->seed = seed;
+    hash->v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    hash->v2 = seed + XXH_PRIME64_2;
+    hash->v3 = seed;
+    hash->v4 = seed - XXH_PRIME64_1;
+}
+
+void JSON_HashUpdate (JSONHash *hash, const void *data, size_t cbData)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    const unsigned char *end = p + cbData;
+    size_t cbFill;
+
+    hash->total += cbData;
+
+    if (hash->cbPending + cbData < 32)
+    {
+        memcpy (hash->pending + hash->cbPending, p, cbData);
+        hash->cbPending += cbData;
+        return;
+    }
+
+    if (hash->cbPending > 0)
+    {
+        cbFill = 32 - hash->cbPending;
+        memcpy (hash->pending + hash->cbPending, p, cbFill);
+        Hash_Stripes (hash, hash->pending, hash->pending + 32);
+        p += cbFill;
+        hash->cbPending = 0;
+    }
+
+    p = Hash_Stripes (hash, p, end);
+
+    memcpy (hash->pending, p, end - p);
+    hash->cbPending = end - p;
+}
+
+JSUINT64 JSON_HashDigest (const JSONHash *hash)
+{
+    const unsigned char *p = hash->pending;
+    const unsigned char *end = p + hash->cbPending;
+    JSUINT64 h;
+
+    if (hash->total >= 32)
+    {
+        h = XXH_ROTL64 (hash->v1, 1) + XXH_ROTL64 (hash->v2, 7) + XXH_ROTL64 (hash->v3, 12) + XXH_ROTL64 (hash->v4, 18);
+        h = Hash_MergeRound (h, hash->v1);
+        h = Hash_MergeRound (h, hash->v2);
+        h = Hash_MergeRound (h, hash->v3);
+        h = Hash_MergeRound (h, hash->v4);
+    }
+    else
+    {
+        h = hash->seed + XXH_PRIME64_5;
+    }
+
+    h += hash->total;
+
+    while (end - p >= 8)
+    {
+        h ^= Hash_Round (0, Hash_Read64 (p));
+        h = XXH_ROTL64 (h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+    }
+
+    if (end - p >= 4)
+    {
+        h ^= Hash_Read32 (p) * XXH_PRIME64_1;
+        h = XXH_ROTL64 (h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+
+    while (p < end)
+    {
+        h ^= (*p) * XXH_PRIME64_5;
+        h = XXH_ROTL64 (h, 11) * XXH_PRIME64_1;
+        p ++;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/*
+Output is hashed once this much of it is pending, while it's still in cache */
+#define JSON_HASH_CHUNK 8192
+
+/*
+Feeds output written since the last call to the hash. Must be called before output is flushed or moved */
+static void Buffer_HashPending (JSONEncodeState *es)
+{
+    if (es->hash && es->offset > es->hashed)
+    {
+        JSON_HashUpdate (es->hash, es->hashed, es->offset - es->hashed);
+    }
+    es->hashed = es->offset;
+}
+
+/*
+Running estimate of how big encoder output gets, an exponentially weighted average over recent
+calls. A buffer outgrowing its initial size jumps straight to it so large outputs don't have to grow
+through every doubling on each call. It's shared by all encoders and threads. Being only a hint it's read and
+written with relaxed atomics rather than under a lock, concurrent updates may overwrite each other */
+#if defined(JSON_NO_THREADS)
+static size_t g_outputSizeEstimate = 0;
+#define Estimate_Load() (g_outputSizeEstimate)
+#define Estimate_Store(__estimate) (g_outputSizeEstimate = (__estimate))
+#elif defined(_WIN32)
+static volatile size_t g_outputSizeEstimate = 0;
+#define Estimate_Load() (g_outputSizeEstimate)
+#define Estimate_Store(__estimate) (g_outputSizeEstimate = (__estimate))
+#else
+static size_t g_outputSizeEstimate = 0;
+#define Estimate_Load() __atomic_load_n (&g_outputSizeEstimate, __ATOMIC_RELAXED)
+#define Estimate_Store(__estimate) __atomic_store_n (&g_outputSizeEstimate, (__estimate), __ATOMIC_RELAXED)
+#endif
 
-static void SetError (JSOBJ obj, JSONObjectEncoder *enc, const char *message)
+static void Buffer_UpdateSizeEstimate (size_t cbOutput)
 {
-    enc->errorMsg = message;
-    enc->errorObj = obj;
+    size_t estimate = Estimate_Load ();
+
+    if (cbOutput > estimate)
+    {
+        estimate += (cbOutput - estimate) / 4;
+    }
+    else
+    {
+        estimate -= (estimate - cbOutput) / 4;
+    }
+
+    Estimate_Store (estimate);
 }
 
 /*
-FIXME: Keep track of how big these get across several encoder calls and try to make an estimate
-That way we won't run our head into the wall each call */
-void Buffer_Realloc (JSONObjectEncoder *enc, size_t cbNeeded)
+Hands everything written so far to the output stream and rewinds the buffer */
+static void Buffer_Flush (JSONEncodeState *es)
+{
+    size_t cbOutput = es->offset - es->start;
+
+    Buffer_HashPending (es);
+
+    if (cbOutput > 0 && !es->errorMsg && es->write (es->writeContext, es->start, cbOutput) != cbOutput)
+    {
+        SetError (NULL, es, "Could not write to output stream");
+    }
+
+    es->offset = es->hashed = es->start;
+    Memo_Invalidate (es);
+}
+
+static void IOVec_NextBuffer (JSONEncodeState *es, size_t cbNeeded);
+
+void Buffer_Realloc (JSONEncodeState *es, size_t cbNeeded)
 {
-    size_t curSize = enc->end - enc->start;
-    size_t newSize = curSize * 2;
-    size_t offset = enc->offset - enc->start;
+    size_t curSize;
+    size_t newSize;
+    size_t offset;
+    size_t estimate = Estimate_Load ();
+
+    Buffer_HashPending (es);
+
+    if (es->iovec)
+    {
+        IOVec_NextBuffer (es, cbNeeded);
+        return;
+    }
+
+    if (es->write)
+    {
+        /*
+        When streaming, make room by flushing and only grow if a single value doesn't fit */
+        Buffer_Flush (es);
+
+        if ((size_t) (es->end - es->offset) >= cbNeeded)
+        {
+            return;
+        }
+
+        estimate = 0;
+    }
+
+    curSize = es->end - es->start;
+    newSize = curSize * 2;
+    offset = es->offset - es->start;
+
+    /*
+    Jump straight to the expected output size the first time we outgrow the initial buffer */
+    if (newSize < estimate)
+    {
+        newSize = estimate;
+    }
 
     while (newSize < curSize + cbNeeded)
     {
         newSize *= 2;
     }
 
-    if (enc->heap)
+    if (es->heap)
     {
-        enc->start = (char *) enc->realloc (enc->start, newSize);
-        if (!enc->start)
+        es->start = (char *) es->realloc (es->start, newSize);
+        if (!es->start)
         {
-            SetError (NULL, enc, "Could not reserve memory block");
+            SetError (NULL, es, "Could not reserve memory block");
             return;
         }
     }
     else
     {
-        char *oldStart = enc->start;
-        enc->heap = 1;
-        enc->start = (char *) enc->malloc (newSize);
-        if (!enc->start)
+        char *oldStart = es->start;
+        es->heap = 1;
+        es->start = (char *) es->malloc (newSize);
+        if (!es->start)
         {
-            SetError (NULL, enc, "Could not reserve memory block");
+            SetError (NULL, es, "Could not reserve memory block");
             return;
         }
-        memcpy (enc->start, oldStart, offset);
+        memcpy (es->start, oldStart, offset);
     }
-    enc->offset = enc->start + offset;
-    enc->end = enc->start + newSize;
+    es->offset = es->hashed = es->start + offset;
+    es->end = es->start + newSize;
 }
 
 FASTCALL_ATTR INLINE_PREFIX void FASTCALL_MSVC Buffer_AppendShortHexUnchecked (char *outputOffset, unsigned short value)
 {
-    *(outputOffset++) = g_hexChars[(value & 0xf000) >> 12];
-    *(outputOffset++) = g_hexChars[(value & 0x0f00) >> 8];
-    *(outputOffset++) = g_hexChars[(value & 0x00f0) >> 4];
-    *(outputOffset++) = g_hexChars[(value & 0x000f) >> 0];
+    memcpy (outputOffset, g_hexPairs + ((value >> 8) * 2), 2);
+    memcpy (outputOffset + 2, g_hexPairs + ((value & 0xff) * 2), 2);
 }
 
-int Buffer_EscapeStringUnvalidated (JSONObjectEncoder *enc, const char *io, const char *end)
+/*
+Writes a complete 6 byte \uXXXX escape */
+FASTCALL_ATTR INLINE_PREFIX void FASTCALL_MSVC Buffer_AppendUnicodeEscapeUnchecked (char *outputOffset, unsigned short value)
 {
-    char *of = (char *) enc->offset;
+    outputOffset[0] = '\\';
+    outputOffset[1] = 'u';
+    Buffer_AppendShortHexUnchecked (outputOffset + 2, value);
+}
 
-    for (;;)
+#define Utf8_IsContinuation(__chr) (((JSUINT8) (__chr) & 0xc0) == 0x80)
+
+#ifdef JSON_SIMD_WIDTH
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+static __inline unsigned int Simd_CountTrailingZeros (unsigned int mask)
+{
+    unsigned long index;
+    _BitScanForward (&index, mask);
+    return (unsigned int) index;
+}
+#else
+#define Simd_CountTrailingZeros(__mask) ((unsigned int) __builtin_ctz(__mask))
+#endif
+
+/*
+Each kernel loads JSON_SIMD_WIDTH bytes from io, stores them unmodified at of and returns the
+number of leading bytes which are not '"', '\\', '/' or below 0x20 (nor above 0x7f when
+asciiOnly is set). A return value of JSON_SIMD_WIDTH means the whole block was safe.
+
+The store is unconditional unless of is NULL, callers must have reserved at least JSON_SIMD_WIDTH
+bytes at of */
+#if defined(JSON_SIMD_AVX2)
+
+static FASTCALL_ATTR INLINE_PREFIX size_t FASTCALL_MSVC Simd_CopyUnescaped (char *of, const char *io, int asciiOnly)
+{
+    __m256i chunk = _mm256_loadu_si256 ((const __m256i *) io);
+    __m256i special = _mm256_or_si256 (
+        _mm256_or_si256 (
+            _mm256_cmpeq_epi8 (chunk, _mm256_set1_epi8 ('\"')),
+            _mm256_cmpeq_epi8 (chunk, _mm256_set1_epi8 ('\\'))),
+        _mm256_or_si256 (
+            _mm256_cmpeq_epi8 (chunk, _mm256_set1_epi8 ('/')),
+            _mm256_cmpeq_epi8 (_mm256_min_epu8 (chunk, _mm256_set1_epi8 (0x1f)), chunk)));
+    unsigned int mask = (unsigned int) _mm256_movemask_epi8 (special);
+
+    if (asciiOnly)
     {
-        switch (*io)
+        mask |= (unsigned int) _mm256_movemask_epi8 (chunk);
+    }
+
+    if (of)
+    {
+        _mm256_storeu_si256 ((__m256i *) of, chunk);
+    }
+    return mask ? Simd_CountTrailingZeros (mask) : JSON_SIMD_WIDTH;
+}
+
+#elif defined(JSON_SIMD_SSE2)
+
+static FASTCALL_ATTR INLINE_PREFIX size_t FASTCALL_MSVC Simd_CopyUnescaped (char *of, const char *io, int asciiOnly)
+{
+    __m128i chunk = _mm_loadu_si128 ((const __m128i *) io);
+    __m128i special = _mm_or_si128 (
+        _mm_or_si128 (
+            _mm_cmpeq_epi8 (chunk, _mm_set1_epi8 ('\"')),
+            _mm_cmpeq_epi8 (chunk, _mm_set1_epi8 ('\\'))),
+        _mm_or_si128 (
+            _mm_cmpeq_epi8 (chunk, _mm_set1_epi8 ('/')),
+            _mm_cmpeq_epi8 (_mm_min_epu8 (chunk, _mm_set1_epi8 (0x1f)), chunk)));
+    unsigned int mask = (unsigned int) _mm_movemask_epi8 (special);
+
+    if (asciiOnly)
+    {
+        mask |= (unsigned int) _mm_movemask_epi8 (chunk);
+    }
+
+    if (of)
+    {
+        _mm_storeu_si128 ((__m128i *) of, chunk);
+    }
+    return mask ? Simd_CountTrailingZeros (mask) : JSON_SIMD_WIDTH;
+}
+
+#elif defined(JSON_SIMD_NEON)
+
+/*
+NEON has no movemask, narrow each byte of the comparison result to a nibble instead */
+static FASTCALL_ATTR INLINE_PREFIX size_t FASTCALL_MSVC Simd_FirstSet (uint8x16_t special)
+{
+    uint64_t mask = vget_lane_u64 (vreinterpret_u64_u8 (vshrn_n_u16 (vreinterpretq_u16_u8 (special), 4)), 0);
+    return mask ? (size_t) (__builtin_ctzll (mask) >> 2) : JSON_SIMD_WIDTH;
+}
+
+static FASTCALL_ATTR INLINE_PREFIX size_t FASTCALL_MSVC Simd_CopyUnescaped (char *of, const char *io, int asciiOnly)
+{
+    uint8x16_t chunk = vld1q_u8 ((const uint8_t *) io);
+    uint8x16_t special = vorrq_u8 (
+        vorrq_u8 (
+            vceqq_u8 (chunk, vdupq_n_u8 ('\"')),
+            vceqq_u8 (chunk, vdupq_n_u8 ('\\'))),
+        vorrq_u8 (
+            vceqq_u8 (chunk, vdupq_n_u8 ('/')),
+            vcltq_u8 (chunk, vdupq_n_u8 (0x20))));
+
+    if (asciiOnly)
+    {
+        special = vorrq_u8 (special, vcgeq_u8 (chunk, vdupq_n_u8 (0x80)));
+    }
+
+    if (of)
+    {
+        vst1q_u8 ((uint8_t *) of, chunk);
+    }
+    return Simd_FirstSet (special);
+}
+
+#endif
+
+#endif
+
+int Buffer_EscapeStringUnvalidated (JSONEncodeState *es, const char *io, const char *end)
+{
+    char *of = (char *) es->offset;
+
+    while (io < end)
+    {
+#ifdef JSON_SIMD_WIDTH
+        /*
+        Copy whole vectors while they need no escaping, the remainder and any byte which
+        needs escaping is handled by the switch below */
+        while (end - io >= JSON_SIMD_WIDTH)
         {
-        case 0x00:
-            if (io < end)
+            size_t cbSafe = Simd_CopyUnescaped (of, io, FALSE);
+            io += cbSafe;
+            of += cbSafe;
+
+            if (cbSafe != JSON_SIMD_WIDTH)
             {
-                *(of++) = '\\';
-                *(of++) = 'u';
-                *(of++) = '0';
-                *(of++) = '0';
-                *(of++) = '0';
-                *(of++) = '0';
                 break;
             }
-            else
-            {
-                enc->offset += (of - enc->offset); 
-                return TRUE;
-            }
+        }
+
+        if (io == end)
+        {
+            break;
+        }
+#endif
+
+        switch (*io)
+        {
+        case 0x00:
+            *(of++) = '\\';
+            *(of++) = 'u';
+            *(of++) = '0';
+            *(of++) = '0';
+            *(of++) = '0';
+            *(of++) = '0';
+            break;
 
         case '\"': (*of++) = '\\'; (*of++) = '\"'; break;
         case '\\': (*of++) = '\\'; (*of++) = '\\'; break;
@@ -208,39 +675,59 @@ int Buffer_EscapeStringUnvalidated (JSONObjectEncoder *enc, const char *io, cons
 
         io++;
     }
+
+    es->offset += (of - es->offset);
+    return TRUE;
 }
 
-int Buffer_EscapeStringValidated (JSOBJ obj, JSONObjectEncoder *enc, const char *io, const char *end)
+int Buffer_EscapeStringValidated (JSOBJ obj, JSONEncodeState *es, const char *io, const char *end)
 {
     JSUTF32 ucs;
-    char *of = (char *) enc->offset;
+    char *of = (char *) es->offset;
 
-    for (;;)
+    while (io < end)
     {
+        JSUINT8 utflen;
+
+#ifdef JSON_SIMD_WIDTH
+        /*
+        Pure ASCII runs are copied a vector at a time. Inside runs of multibyte sequences the
+        vector loop is skipped entirely since it would bail out on the very first byte */
+        if ((JSUINT8) *io < 0x80)
+        {
+            while (end - io >= JSON_SIMD_WIDTH)
+            {
+                size_t cbSafe = Simd_CopyUnescaped (of, io, TRUE);
+                io += cbSafe;
+                of += cbSafe;
+
+                if (cbSafe != JSON_SIMD_WIDTH)
+                {
+                    break;
+                }
+            }
+
+            if (io == end)
+            {
+                break;
+            }
+        }
+#endif
 
-        //JSUINT8 chr = (unsigned char) *io;
-        JSUINT8 utflen = g_asciiOutputTable[(unsigned char) *io];
+        utflen = g_asciiOutputTable[(unsigned char) *io];
 
         switch (utflen)
         {
             case 0: 
             {
-                if (io < end)
-                {
-                    *(of++) = '\\';
-                    *(of++) = 'u';
-                    *(of++) = '0';
-                    *(of++) = '0';
-                    *(of++) = '0';
-                    *(of++) = '0';
-                    io ++;
-                    continue;
-                }
-                else
-                {
-                    enc->offset += (of - enc->offset); 
-                    return TRUE;
-                }
+                *(of++) = '\\';
+                *(of++) = 'u';
+                *(of++) = '0';
+                *(of++) = '0';
+                *(of++) = '0';
+                *(of++) = '0';
+                io ++;
+                continue;
             }
 
             case 1:
@@ -254,10 +741,17 @@ int Buffer_EscapeStringValidated (JSOBJ obj, JSONObjectEncoder *enc, const char
                 JSUTF32 in;
                 JSUTF16 in16;
 
-                if (end - io < 1)
+                if (end - io < 2)
+                {
+                    es->offset += (of - es->offset);
+                    SetError (obj, es, "Unterminated UTF-8 sequence when encoding string");
+                    return FALSE;
+                }
+
+                if (!Utf8_IsContinuation(io[1]))
                 {
-                    enc->offset += (of - enc->offset);
-                    SetError (obj, enc, "Unterminated UTF-8 sequence when encoding string");
+                    es->offset += (of - es->offset);
+                    SetError (obj, es, "Invalid UTF-8 continuation byte when encoding string");
                     return FALSE;
                 }
 
@@ -272,8 +766,8 @@ int Buffer_EscapeStringValidated (JSOBJ obj, JSONObjectEncoder *enc, const char
 
                 if (ucs < 0x80)
                 {
-                    enc->offset += (of - enc->offset);
-                    SetError (obj, enc, "Overlong 2 byte UTF-8 sequence detected when encoding string");
+                    es->offset += (of - es->offset);
+                    SetError (obj, es, "Overlong 2 byte UTF-8 sequence detected when encoding string");
                     return FALSE;
                 }
 
@@ -287,10 +781,17 @@ int Buffer_EscapeStringValidated (JSOBJ obj, JSONObjectEncoder *enc, const char
                 JSUTF16 in16;
                 JSUINT8 in8;
 
-                if (end - io < 2)
+                if (end - io < 3)
+                {
+                    es->offset += (of - es->offset);
+                    SetError (obj, es, "Unterminated UTF-8 sequence when encoding string");
+                    return FALSE;
+                }
+
+                if (!Utf8_IsContinuation(io[1]) || !Utf8_IsContinuation(io[2]))
                 {
-                    enc->offset += (of - enc->offset);
-                    SetError (obj, enc, "Unterminated UTF-8 sequence when encoding string");
+                    es->offset += (of - es->offset);
+                    SetError (obj, es, "Invalid UTF-8 continuation byte when encoding string");
                     return FALSE;
                 }
 
@@ -309,22 +810,47 @@ int Buffer_EscapeStringValidated (JSOBJ obj, JSONObjectEncoder *enc, const char
 
                 if (ucs < 0x800)
                 {
-                    enc->offset += (of - enc->offset);
-                    SetError (obj, enc, "Overlong 3 byte UTF-8 sequence detected when encoding string");
+                    es->offset += (of - es->offset);
+                    SetError (obj, es, "Overlong 3 byte UTF-8 sequence detected when encoding string");
                     return FALSE;
                 }
 
                 io += 3;
-                break;
+
+                /*
+                Runs of 3 byte sequences (most of CJK) are escaped here without another trip through
+                the dispatch above. Anything unusual ends the run and is handled by the regular path */
+                while (end - io >= 3 && ((JSUINT8) io[0] & 0xf0) == 0xe0 && Utf8_IsContinuation(io[1]) && Utf8_IsContinuation(io[2]))
+                {
+                    JSUTF32 next = (((JSUINT8) io[0] & 0x0f) << 12) | (((JSUINT8) io[1] & 0x3f) << 6) | ((JSUINT8) io[2] & 0x3f);
+
+                    if (next < 0x800)
+                    {
+                        break;
+                    }
+
+                    Buffer_AppendUnicodeEscapeUnchecked(of, (unsigned short) ucs);
+                    of += 6;
+                    ucs = next;
+                    io += 3;
+                }
+                break;
             }
             case 4:
             {
                 JSUTF32 in;
                 
-                if (end - io < 3)
+                if (end - io < 4)
+                {
+                    es->offset += (of - es->offset);
+                    SetError (obj, es, "Unterminated UTF-8 sequence when encoding string");
+                    return FALSE;
+                }
+
+                if (!Utf8_IsContinuation(io[1]) || !Utf8_IsContinuation(io[2]) || !Utf8_IsContinuation(io[3]))
                 {
-                    enc->offset += (of - enc->offset);
-                    SetError (obj, enc, "Unterminated UTF-8 sequence when encoding string");
+                    es->offset += (of - es->offset);
+                    SetError (obj, es, "Invalid UTF-8 continuation byte when encoding string");
                     return FALSE;
                 }
 
@@ -336,8 +862,8 @@ int Buffer_EscapeStringValidated (JSOBJ obj, JSONObjectEncoder *enc, const char
 #endif
                 if (ucs < 0x10000)
                 {
-                    enc->offset += (of - enc->offset);
-                    SetError (obj, enc, "Overlong 4 byte UTF-8 sequence detected when encoding string");
+                    es->offset += (of - es->offset);
+                    SetError (obj, es, "Overlong 4 byte UTF-8 sequence detected when encoding string");
                     return FALSE;
                 }
 
@@ -348,8 +874,13 @@ int Buffer_EscapeStringValidated (JSOBJ obj, JSONObjectEncoder *enc, const char
 
             case 5:
             case 6:
-                enc->offset += (of - enc->offset);
-                SetError (obj, enc, "Unsupported UTF-8 sequence length when encoding string");
+                es->offset += (of - es->offset);
+                SetError (obj, es, "Unsupported UTF-8 sequence length when encoding string");
+                return FALSE;
+
+            case 7:
+                es->offset += (of - es->offset);
+                SetError (obj, es, "Invalid UTF-8 lead byte when encoding string");
                 return FALSE;
 
             case 30:
@@ -387,24 +918,19 @@ int Buffer_EscapeStringValidated (JSOBJ obj, JSONObjectEncoder *enc, const char
         if (ucs >= 0x10000)
         {
             ucs -= 0x10000;
-            *(of++) = '\\';
-            *(of++) = 'u';
-            Buffer_AppendShortHexUnchecked(of, (unsigned short) (ucs >> 10) + 0xd800);
-            of += 4;
-
-            *(of++) = '\\';
-            *(of++) = 'u';
-            Buffer_AppendShortHexUnchecked(of, (unsigned short) (ucs & 0x3ff) + 0xdc00);
-            of += 4;
+            Buffer_AppendUnicodeEscapeUnchecked(of, (unsigned short) (ucs >> 10) + 0xd800);
+            Buffer_AppendUnicodeEscapeUnchecked(of + 6, (unsigned short) (ucs & 0x3ff) + 0xdc00);
+            of += 12;
         }
         else
         {
-            *(of++) = '\\';
-            *(of++) = 'u';
-            Buffer_AppendShortHexUnchecked(of, (unsigned short) ucs);
-            of += 4;
+            Buffer_AppendUnicodeEscapeUnchecked(of, (unsigned short) ucs);
+            of += 6;
         }
     }
+
+    es->offset += (of - es->offset);
+    return TRUE;
 }
 
 #define Buffer_Reserve(__enc, __len) \
@@ -424,45 +950,460 @@ FASTCALL_ATTR INLINE_PREFIX void FASTCALL_MSVC strreverse(char* begin, char* end
     aux = *end, *end-- = *begin, *begin++ = aux;
 }
 
-void Buffer_AppendIntUnchecked(JSONObjectEncoder *enc, JSINT32 value)
+/*
+Integers are written back to front two digits at a time. The digit count is known up front so
+the number lands in its final place and never needs to be reversed */
+static FASTCALL_ATTR INLINE_PREFIX int FASTCALL_MSVC Buffer_CountDigits32 (JSUINT32 value)
 {
-    char* wstr;
-    JSUINT32 uvalue = (value < 0) ? -value : value;
+    int count = 1;
 
-    wstr = enc->offset;
-    // Conversion. Number is reversed.
-    
-    do *wstr++ = (char)(48 + (uvalue % 10)); while(uvalue /= 10);
-    if (value < 0) *wstr++ = '-';
+    for (;;)
+    {
+        if (value < 10) return count;
+        if (value < 100) return count + 1;
+        if (value < 1000) return count + 2;
+        if (value < 10000) return count + 3;
+        value /= 10000;
+        count += 4;
+    }
+}
+
+static FASTCALL_ATTR INLINE_PREFIX int FASTCALL_MSVC Buffer_CountDigits64 (JSUINT64 value)
+{
+    int count = 1;
+
+    for (;;)
+    {
+        if (value < 10) return count;
+        if (value < 100) return count + 1;
+        if (value < 1000) return count + 2;
+        if (value < 10000) return count + 3;
+        value /= 10000ULL;
+        count += 4;
+    }
+}
+
+static FASTCALL_ATTR INLINE_PREFIX char * FASTCALL_MSVC Buffer_WriteDigits32 (char *of, JSUINT32 value)
+{
+    char *end = of + Buffer_CountDigits32 (value);
+    char *wstr = end;
+
+    while (value >= 100)
+    {
+        JSUINT32 pair = (value % 100) * 2;
+        value /= 100;
+        wstr -= 2;
+        memcpy (wstr, g_digitPairs + pair, 2);
+    }
+
+    if (value >= 10)
+    {
+        memcpy (wstr - 2, g_digitPairs + (value * 2), 2);
+    }
+    else
+    {
+        *(wstr - 1) = (char) ('0' + value);
+    }
 
-    // Reverse string
-    strreverse(enc->offset,wstr - 1);
-    enc->offset += (wstr - (enc->offset));
+    return end;
 }
 
-void Buffer_AppendLongUnchecked(JSONObjectEncoder *enc, JSINT64 value)
+static FASTCALL_ATTR INLINE_PREFIX char * FASTCALL_MSVC Buffer_WriteDigits64 (char *of, JSUINT64 value)
 {
-    char* wstr;
-    JSUINT64 uvalue = (value < 0) ? -value : value;
+    char *end = of + Buffer_CountDigits64 (value);
+    char *wstr = end;
 
-    wstr = enc->offset;
-    // Conversion. Number is reversed.
-    
-    do *wstr++ = (char)(48 + (uvalue % 10ULL)); while(uvalue /= 10ULL);
-    if (value < 0) *wstr++ = '-';
+    /*
+    Stay in 64 bit arithmetic only while the value needs it */
+    while (value > 0xFFFFFFFFULL)
+    {
+        JSUINT32 pair = (JSUINT32) (value % 100ULL) * 2;
+        value /= 100ULL;
+        wstr -= 2;
+        memcpy (wstr, g_digitPairs + pair, 2);
+    }
+
+    Buffer_WriteDigits32 (of, (JSUINT32) value);
+    return end;
+}
+
+void Buffer_AppendIntUnchecked(JSONEncodeState *es, JSINT32 value)
+{
+    JSUINT32 uvalue = (JSUINT32) value;
+
+    if (value < 0)
+    {
+        Buffer_AppendCharUnchecked(es, '-');
+        uvalue = 0 - uvalue;
+    }
+
+    es->offset = Buffer_WriteDigits32 (es->offset, uvalue);
+}
+
+void Buffer_AppendLongUnchecked(JSONEncodeState *es, JSINT64 value)
+{
+    JSUINT64 uvalue = (JSUINT64) value;
+
+    if (value < 0)
+    {
+        Buffer_AppendCharUnchecked(es, '-');
+        uvalue = 0 - uvalue;
+    }
+
+    es->offset = Buffer_WriteDigits64 (es->offset, uvalue);
+}
+
+/*
+Short round trip double formatting, an implementation of Florian Loitsch's Grisu2
+("Printing Floating-Point Numbers Quickly and Accurately with Integers", PLDI 2010).
+
+The generated digits always parse back to the exact same double. They are the shortest such
+representation for the vast majority of inputs, a few rare cases get one extra digit. */
+typedef struct __DiyFp
+{
+    JSUINT64 f;
+    int e;
+} DiyFp;
+
+#define DIYFP_SIGNIFICAND_MASK 0x000FFFFFFFFFFFFFULL
+#define DIYFP_HIDDEN_BIT 0x0010000000000000ULL
+
+static const JSUINT32 g_pow10u32[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000};
+
+/*
+Cached powers of ten for Grisu2, 10^k for k = -348, -340, ..., 340 as normalized 64 bit
+significand and binary exponent */
+static const JSUINT64 g_cachedPowersF[] =
+{
+    0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL, 0xcf42894a5dce35eaULL,
+    0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL, 0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL,
+    0xbe5691ef416bd60cULL, 0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+    0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL, 0xc21094364dfb5637ULL,
+    0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL, 0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL,
+    0xb23867fb2a35b28eULL, 0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+    0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL, 0xb5b5ada8aaff80b8ULL,
+    0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL, 0x964e858c91ba2655ULL, 0xdff9772470297ebdULL,
+    0xa6dfbd9fb8e5b88fULL, 0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+    0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL, 0xaa242499697392d3ULL,
+    0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL, 0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL,
+    0x9c40000000000000ULL, 0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+    0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL, 0x9f4f2726179a2245ULL,
+    0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL, 0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL,
+    0x924d692ca61be758ULL, 0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+    0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL, 0x952ab45cfa97a0b3ULL,
+    0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL, 0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL,
+    0x88fcf317f22241e2ULL, 0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+    0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL, 0x8bab8eefb6409c1aULL,
+    0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL, 0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL,
+    0x80444b5e7aa7cf85ULL, 0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+    0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL
+};
+
+static const short g_cachedPowersE[] =
+{
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927, -901, -874, -847,
+    -821, -794, -768, -741, -715, -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183, -157, -130, -103, -77, -50,
+    -24, 3, 30, 56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614, 641, 667, 694, 720, 747,
+    774, 800, 827, 853, 880, 907, 933, 960, 986, 1013, 1039, 1066
+};
+
+static FASTCALL_ATTR INLINE_PREFIX DiyFp FASTCALL_MSVC DiyFp_Multiply (DiyFp x, DiyFp y)
+{
+    const JSUINT64 M32 = 0xFFFFFFFFULL;
+    JSUINT64 a = x.f >> 32, b = x.f & M32, c = y.f >> 32, d = y.f & M32;
+    JSUINT64 ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    JSUINT64 tmp = (bd >> 32) + (ad & M32) + (bc & M32);
+    DiyFp r;
+
+    tmp += 1U << 31; /* round */
+    r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+    r.e = x.e + y.e + 64;
+    return r;
+}
+
+static FASTCALL_ATTR INLINE_PREFIX DiyFp FASTCALL_MSVC DiyFp_Normalize (DiyFp x)
+{
+    while (!(x.f & 0x8000000000000000ULL))
+    {
+        x.f <<= 1;
+        x.e --;
+    }
+    return x;
+}
+
+static int Grisu_CountDecimalDigits (JSUINT32 n)
+{
+    int count = 1;
+    while (count < 10 && n >= g_pow10u32[count])
+    {
+        count ++;
+    }
+    return count;
+}
+
+static void Grisu_Round (char *buffer, int len, JSUINT64 delta, JSUINT64 rest, JSUINT64 tenKappa, JSUINT64 wpw)
+{
+    while (rest < wpw && delta - rest >= tenKappa &&
+        (rest + tenKappa < wpw || wpw - rest > rest + tenKappa - wpw))
+    {
+        buffer[len - 1] --;
+        rest += tenKappa;
+    }
+}
+
+static void Grisu_DigitGen (DiyFp W, DiyFp Mp, JSUINT64 delta, char *buffer, int *len, int *K)
+{
+    DiyFp one;
+    JSUINT64 wpw = Mp.f - W.f;
+    JSUINT32 p1;
+    JSUINT64 p2;
+    int kappa;
+
+    one.f = ((JSUINT64) 1) << -Mp.e;
+    one.e = Mp.e;
+    p1 = (JSUINT32) (Mp.f >> -one.e);
+    p2 = Mp.f & (one.f - 1);
+    kappa = Grisu_CountDecimalDigits (p1);
+    *len = 0;
+
+    while (kappa > 0)
+    {
+        JSUINT32 d = p1 / g_pow10u32[kappa - 1];
+        JSUINT64 tmp;
+
+        p1 %= g_pow10u32[kappa - 1];
+
+        if (d || *len)
+        {
+            buffer[(*len)++] = (char) ('0' + d);
+        }
+
+        kappa --;
+        tmp = (((JSUINT64) p1) << -one.e) + p2;
+
+        if (tmp <= delta)
+        {
+            *K += kappa;
+            Grisu_Round (buffer, *len, delta, tmp, ((JSUINT64) g_pow10u32[kappa]) << -one.e, wpw);
+            return;
+        }
+    }
+
+    for (;;)
+    {
+        char d;
+
+        p2 *= 10;
+        delta *= 10;
+        d = (char) (p2 >> -one.e);
+
+        if (d || *len)
+        {
+            buffer[(*len)++] = (char) ('0' + d);
+        }
+
+        p2 &= one.f - 1;
+        kappa --;
+
+        if (p2 < delta)
+        {
+            *K += kappa;
+            Grisu_Round (buffer, *len, delta, p2, one.f, wpw * (-kappa < 10 ? g_pow10u32[-kappa] : 0));
+            return;
+        }
+    }
+}
+
+/*
+Generates the digits of a finite, positive, non zero value into buffer (at least 17 bytes)
+such that value == digits * 10^K */
+static void Grisu2 (double value, char *buffer, int *length, int *K)
+{
+    JSUINT64 bits;
+    DiyFp v, w, wPlus, wMinus, cached;
+    int biasedE, k;
+    unsigned int index;
+    double dk;
+
+    memcpy (&bits, &value, sizeof (double));
+    biasedE = (int) ((bits >> 52) & 0x7FF);
+    v.f = bits & DIYFP_SIGNIFICAND_MASK;
+
+    if (biasedE)
+    {
+        v.f += DIYFP_HIDDEN_BIT;
+        v.e = biasedE - 1075;
+    }
+    else
+    {
+        v.e = -1074;
+    }
+
+    /*
+    Boundaries m- and m+, halfway to the neighbouring doubles, normalized to the same exponent */
+    wPlus.f = (v.f << 1) + 1;
+    wPlus.e = v.e - 1;
+    while (!(wPlus.f & (DIYFP_HIDDEN_BIT << 1)))
+    {
+        wPlus.f <<= 1;
+        wPlus.e --;
+    }
+    wPlus.f <<= 64 - 52 - 2;
+    wPlus.e -= 64 - 52 - 2;
+
+    if (v.f == DIYFP_HIDDEN_BIT)
+    {
+        wMinus.f = (v.f << 2) - 1;
+        wMinus.e = v.e - 2;
+    }
+    else
+    {
+        wMinus.f = (v.f << 1) - 1;
+        wMinus.e = v.e - 1;
+    }
+    wMinus.f <<= wMinus.e - wPlus.e;
+    wMinus.e = wPlus.e;
+
+    /*
+    Pick a cached power of ten which scales m+ into the range where the digit generation works */
+    dk = (-61 - wPlus.e) * 0.30102999566398114 + 347;
+    k = (int) dk;
+    if (dk - k > 0.0)
+    {
+        k ++;
+    }
+    index = (unsigned int) ((k >> 3) + 1);
+    *K = -(-348 + (int) (index * 8));
+    cached.f = g_cachedPowersF[index];
+    cached.e = g_cachedPowersE[index];
+
+    w = DiyFp_Multiply (DiyFp_Normalize (v), cached);
+    wPlus = DiyFp_Multiply (wPlus, cached);
+    wMinus = DiyFp_Multiply (wMinus, cached);
+    wMinus.f ++;
+    wPlus.f --;
+
+    Grisu_DigitGen (w, wPlus, wPlus.f - wMinus.f, buffer, length, K);
+}
+
+/*
+Writes digits * 10^K as a JSON number. Plain notation is used while the decimal point stays
+close to the digits, exponent notation otherwise. Returns the new output position */
+static char *Double_FormatDigits (char *of, const char *digits, int length, int K)
+{
+    int point = length + K;
+    int exponent;
+
+    if (point >= length && point <= 16)
+    {
+        /* 1234e3 -> 1234000.0 */
+        memcpy (of, digits, length);
+        of += length;
+        memset (of, '0', point - length);
+        of += point - length;
+        *(of++) = '.';
+        *(of++) = '0';
+        return of;
+    }
+
+    if (point > 0 && point <= 16)
+    {
+        /* 1234e-2 -> 12.34 */
+        memcpy (of, digits, point);
+        of += point;
+        *(of++) = '.';
+        memcpy (of, digits + point, length - point);
+        return of + (length - point);
+    }
+
+    if (point > -5 && point <= 0)
+    {
+        /* 1234e-6 -> 0.001234 */
+        *(of++) = '0';
+        *(of++) = '.';
+        memset (of, '0', -point);
+        of += -point;
+        memcpy (of, digits, length);
+        return of + length;
+    }
+
+    /* 1234e20 -> 1.234e+23 */
+    *(of++) = digits[0];
+    if (length > 1)
+    {
+        *(of++) = '.';
+        memcpy (of, digits + 1, length - 1);
+        of += length - 1;
+    }
+
+    *(of++) = 'e';
+    exponent = point - 1;
+    if (exponent < 0)
+    {
+        *(of++) = '-';
+        exponent = -exponent;
+    }
+    else
+    {
+        *(of++) = '+';
+    }
+
+    if (exponent >= 100)
+    {
+        *(of++) = (char) ('0' + exponent / 100);
+        exponent %= 100;
+        *(of++) = (char) ('0' + exponent / 10);
+    }
+    else
+    if (exponent >= 10)
+    {
+        *(of++) = (char) ('0' + exponent / 10);
+    }
+    *(of++) = (char) ('0' + exponent % 10);
+    return of;
+}
+
+/*
+Appends a short representation of a finite value which parses back to the exact same double,
+occasionally one digit longer than the shortest one (Grisu2 has no fallback for the cases it can't settle) */
+void Buffer_AppendDoubleShortestUnchecked (JSONEncodeState *es, double value)
+{
+    char digits[20];
+    int length, K;
+    char *of = es->offset;
+    JSUINT64 bits;
+
+    /*
+    Test the sign bit rather than value < 0 so that -0.0 round trips too */
+    memcpy (&bits, &value, sizeof (double));
+    if (bits >> 63)
+    {
+        *(of++) = '-';
+        value = -value;
+    }
 
-    // Reverse string
-    strreverse(enc->offset,wstr - 1);
-    enc->offset += (wstr - (enc->offset));
+    if (value == 0.0)
+    {
+        *(of++) = '0';
+        *(of++) = '.';
+        *(of++) = '0';
+        es->offset = of;
+        return;
+    }
+
+    Grisu2 (value, digits, &length, &K);
+    es->offset = Double_FormatDigits (of, digits, length, K);
 }
 
-int Buffer_AppendDoubleUnchecked(JSOBJ obj, JSONObjectEncoder *enc, double value)
+int Buffer_AppendDoubleUnchecked(JSOBJ obj, JSONEncodeState *es, double value)
 {
     /* if input is larger than thres_max, revert to exponential */
     const double thres_max = (double) 1e16 - 1;
     int count;
     double diff = 0.0;
-    char* str = enc->offset;
+    char* str = es->offset;
     char* wstr = str;
     unsigned long long whole;
     double tmp;
@@ -472,15 +1413,34 @@ int Buffer_AppendDoubleUnchecked(JSOBJ obj, JSONObjectEncoder *enc, double value
 
     if (value == HUGE_VAL || value == -HUGE_VAL)
     {
-        SetError (obj, enc, "Invalid Inf value when encoding double");
+        SetError (obj, es, "Invalid Inf value when encoding double");
         return FALSE;
     }
     if (! (value == value)) 
     {
-        SetError (obj, enc, "Invalid Nan value when encoding double");
+        SetError (obj, es, "Invalid Nan value when encoding double");
         return FALSE;
     }
 
+    if (es->encoder->canonical)
+    {
+        if (value > -9007199254740992.0 && value < 9007199254740992.0 && (double) (JSINT64) value == value)
+        {
+            Buffer_AppendLongUnchecked (es, (JSINT64) value);
+        }
+        else
+        {
+            Buffer_AppendDoubleShortestUnchecked (es, value);
+        }
+        return TRUE;
+    }
+
+    if (es->encoder->doubleShortest)
+    {
+        Buffer_AppendDoubleShortestUnchecked (es, value);
+        return TRUE;
+    }
+
 
     /* we'll work in positive values and deal with the
     negative sign issue later */
@@ -491,7 +1451,7 @@ int Buffer_AppendDoubleUnchecked(JSOBJ obj, JSONObjectEncoder *enc, double value
         value = -value;
     }
 
-    pow10 = g_pow10[enc->doublePrecision];
+    pow10 = g_pow10[es->doublePrecision];
 
     whole = (unsigned long long) value;
     tmp = (value - whole) * pow10;
@@ -516,23 +1476,15 @@ int Buffer_AppendDoubleUnchecked(JSOBJ obj, JSONObjectEncoder *enc, double value
         ++frac;
     }
 
-    /* for very large numbers switch back to native sprintf for exponentials.
-    anyone want to write code to replace this? */
-    /*
-    normal printf behavior is to print EVERY whole number digit
-    which can be 100s of characters overflowing your buffers == bad
-    */
+    /* for very large numbers switch to exponential notation, printing
+    EVERY whole number digit could be 100s of characters */
     if (value > thres_max) 
     {
-#ifdef _WIN32
-        enc->offset += sprintf_s(str, enc->end - enc->offset, "%.15e", neg ? -value : value);
-#else
-        enc->offset += snprintf(str, enc->end - enc->offset, "%.15e", neg ? -value : value);
-#endif
+        Buffer_AppendDoubleShortestUnchecked (es, neg ? -value : value);
         return TRUE;
     }
 
-    if (enc->doublePrecision == 0) 
+    if (es->doublePrecision == 0) 
     {
         diff = value - whole;
 
@@ -554,7 +1506,7 @@ int Buffer_AppendDoubleUnchecked(JSOBJ obj, JSONObjectEncoder *enc, double value
     else 
     if (frac) 
     { 
-        count = enc->doublePrecision;
+        count = es->doublePrecision;
         // now do fractional part, as an unsigned number
         // we know it is not 0 but we can have leading zeros, these
         // should be removed
@@ -595,292 +1547,2723 @@ int Buffer_AppendDoubleUnchecked(JSOBJ obj, JSONObjectEncoder *enc, double value
         *wstr++ = '-';
     }
     strreverse(str, wstr-1);
-    enc->offset += (wstr - (enc->offset));
+    es->offset += (wstr - (es->offset));
 
     return TRUE;
 }
 
-
-
-
-
-
-/*
-FIXME:
-Handle integration functions returning NULL here */
-
 /*
-FIXME:
-Perhaps implement recursion detection */
-
-void encode(JSOBJ obj, JSONObjectEncoder *enc, const char *name, size_t cbName)
+Writes mantissa * 10^-scale without going through a double, so the output is exact and as cheap as an
+integer. The decimal is written as given, 1.50 stays 1.50, and a negative scale becomes an exponent (12E+3).
+Canonical output drops all trailing zeros and writes the rest out in full while the scale stays within
+JSON_DECIMAL_MAX_SCALE, as d.ddde+N like canonical doubles beyond. Equal decimals then give the same bytes
+and integral ones the same bytes as the equal integer. Bindings that write larger decimals themselves
+should use the same form */
+int Buffer_AppendDecimal(JSOBJ obj, JSONEncodeState *es, JSINT64 mantissa, int scale)
 {
-    const char *value;
-    char *objName;
+    JSUINT64 uvalue = (JSUINT64) mantissa;
+    char *of;
     int count;
-    JSOBJ iterObj;
-    size_t szlen;
-    JSONTypeContext tc;
 
-    if (enc->level > enc->recursionMax)
+    if (scale > JSON_DECIMAL_MAX_SCALE || scale < -JSON_DECIMAL_MAX_SCALE)
     {
-        SetError (obj, enc, "Maximum recursion level reached");
-        return;
+        SetError (obj, es, "Scale out of range when encoding decimal");
+        return FALSE;
     }
 
     /*
-    This reservation must hold 
-
-    length of _name as encoded worst case +
-    maxLength of double to string OR maxLength of JSLONG to string
-
-    Since input is assumed to be UTF-8 the worst character length is:
-
-    4 bytes (of UTF-8) => "\uXXXX\uXXXX" (12 bytes)
-    */
-
-    Buffer_Reserve(enc, 256 + (((cbName / 4) + 1) * 12));
-    if (enc->errorMsg)
+    Sign, leading "0.", the zeros the scale calls for and up to 20 digits */
+    Buffer_Reserve(es, 3 + (scale < 0 ? -scale : scale) + 20);
+    if (es->errorMsg)
     {
-        return;
+        return FALSE;
     }
 
-    if (name)
+    if (mantissa < 0)
     {
-        Buffer_AppendCharUnchecked(enc, '\"');
+        Buffer_AppendCharUnchecked(es, '-');
+        uvalue = 0 - uvalue;
+    }
 
-        if (enc->forceASCII)
+    of = es->offset;
+
+    if (es->encoder->canonical)
+    {
+        if (uvalue == 0)
         {
-            if (!Buffer_EscapeStringValidated(obj, enc, name, name + cbName))
-            {
-                return;
-            }
+            scale = 0;
         }
-        else
+
+        while (uvalue != 0 && uvalue % 10 == 0)
         {
-            if (!Buffer_EscapeStringUnvalidated(enc, name, name + cbName))
-            {
-                return;
-            }
+            uvalue /= 10;
+            scale --;
         }
 
+        if (scale < -JSON_DECIMAL_MAX_SCALE)
+        {
+            count = Buffer_CountDigits64 (uvalue);
+            Buffer_WriteDigits64 (of, uvalue);
 
-        Buffer_AppendCharUnchecked(enc, '\"');
+            if (count > 1)
+            {
+                memmove (of + 2, of + 1, count - 1);
+                of[1] = '.';
+                of ++;
+            }
 
-        Buffer_AppendCharUnchecked (enc, ':');
-#ifndef JSON_NO_EXTRA_WHITESPACE
-        Buffer_AppendCharUnchecked (enc, ' ');
-#endif
+            of += count;
+            *(of++) = 'e';
+            *(of++) = '+';
+            es->offset = Buffer_WriteDigits32 (of, (JSUINT32) (count - 1 - scale));
+            return TRUE;
+        }
     }
 
-    enc->beginTypeContext(obj, &tc);
-
-    switch (tc.type)
+    if (scale > 0)
     {
-        case JT_INVALID:
-            return;
+        count = Buffer_CountDigits64 (uvalue);
 
-        case JT_ARRAY:
+        if (count > scale)
         {
-            count = 0;
-            enc->iterBegin(obj, &tc);
-
-            Buffer_AppendCharUnchecked (enc, '[');
-
-            while (enc->iterNext(obj, &tc))
-            {
-                if (count > 0)
-                {
-                    Buffer_AppendCharUnchecked (enc, ',');
+            /*
+            Shift the fraction digits over by one to make room for the point */
+            Buffer_WriteDigits64 (of, uvalue);
+            memmove (of + count - scale + 1, of + count - scale, scale);
+            of[count - scale] = '.';
+            of += count + 1;
+        }
+        else
+        {
+            *(of++) = '0';
+            *(of++) = '.';
+            memset (of, '0', scale - count);
+            of = Buffer_WriteDigits64 (of + scale - count, uvalue);
+        }
+    }
+    else
+    {
+        of = Buffer_WriteDigits64 (of, uvalue);
+
+        if (scale < 0 && es->encoder->canonical)
+        {
+            memset (of, '0', -scale);
+            of += -scale;
+        }
+        else
+        if (scale < 0)
+        {
+            *(of++) = 'E';
+            *(of++) = '+';
+            of = Buffer_WriteDigits32 (of, (JSUINT32) -scale);
+        }
+    }
+
+    es->offset = of;
+    return TRUE;
+}
+
+
+
+
+
+
+/*
+Object key cache
+
+Row oriented documents repeat the same handful of keys over and over. Once an encode has seen
+JSON_KEY_CACHE_THRESHOLD keys, the quoted and escaped form of each short key ("key": ) is kept in a
+small direct mapped table and copied out on later hits instead of being escaped again.
+
+Slots are picked by hashing the key bytes rather than the key pointer since integrations may hand out
+temporary buffers (eg. UTF-8 conversions) whose addresses get reused for different keys. A hit is
+always confirmed by comparing the stored key bytes. */
+
+#define JSON_KEY_CACHE_SIZE 64
+#define JSON_KEY_CACHE_THRESHOLD 16
+#define JSON_KEY_CACHE_MAX_NAME 32
+#define JSON_KEY_CACHE_MAX_OUTPUT 64
+
+typedef struct __JSONKeyCacheEntry
+{
+    size_t cbName;
+    size_t cbOutput;
+    char name[JSON_KEY_CACHE_MAX_NAME];
+    char output[JSON_KEY_CACHE_MAX_OUTPUT];
+} JSONKeyCacheEntry;
+
+struct __JSONKeyCache
+{
+    JSONKeyCacheEntry entries[JSON_KEY_CACHE_SIZE];
+};
+
+static FASTCALL_ATTR INLINE_PREFIX JSUINT32 FASTCALL_MSVC KeyCache_Hash (const char *name, size_t cbName)
+{
+    JSUINT32 hash = 2166136261U ^ (JSUINT32) cbName;
+    const JSUINT8 *io = (const JSUINT8 *) name;
+    const JSUINT8 *end = io + cbName;
+
+    while (io < end)
+    {
+        hash = (hash ^ *io++) * 16777619U;
+    }
+
+    return hash ^ (hash >> 15);
+}
+
+static void KeyCache_Free (JSONEncodeState *es)
+{
+    if (es->keyCache)
+    {
+        es->free (es->keyCache);
+        es->keyCache = NULL;
+    }
+}
+
+/*
+Appends "name": to the buffer, the caller must have reserved room for the worst case escaping of name */
+static int Buffer_AppendKeyUnchecked (JSOBJ obj, JSONEncodeState *es, const char *name, size_t cbName)
+{
+    JSONKeyCacheEntry *entry = NULL;
+    char *keyStart = es->offset;
+    size_t cbOutput;
+
+    if (cbName <= JSON_KEY_CACHE_MAX_NAME)
+    {
+        if (es->keyCache == NULL && ++es->keyCount >= JSON_KEY_CACHE_THRESHOLD)
+        {
+            es->keyCache = (struct __JSONKeyCache *) es->malloc (sizeof (struct __JSONKeyCache));
+            if (es->keyCache)
+            {
+                memset (es->keyCache, 0, sizeof (struct __JSONKeyCache));
+            }
+        }
+
+        if (es->keyCache)
+        {
+            entry = &es->keyCache->entries[KeyCache_Hash (name, cbName) & (JSON_KEY_CACHE_SIZE - 1)];
+
+            if (entry->cbOutput > 0 && entry->cbName == cbName && memcmp (entry->name, name, cbName) == 0)
+            {
+                memcpy (es->offset, entry->output, entry->cbOutput);
+                es->offset += entry->cbOutput;
+                return TRUE;
+            }
+        }
+    }
+
+    Buffer_AppendCharUnchecked(es, '\"');
+
+    if (es->encoder->forceASCII)
+    {
+        if (!Buffer_EscapeStringValidated(obj, es, name, name + cbName))
+        {
+            return FALSE;
+        }
+    }
+    else
+    {
+        if (!Buffer_EscapeStringUnvalidated(es, name, name + cbName))
+        {
+            return FALSE;
+        }
+    }
+
+    Buffer_AppendCharUnchecked(es, '\"');
+
+    Buffer_AppendCharUnchecked (es, ':');
+#ifndef JSON_NO_EXTRA_WHITESPACE
+    Buffer_AppendCharUnchecked (es, ' ');
+#endif
+
+    cbOutput = es->offset - keyStart;
+
+    if (entry && cbOutput <= JSON_KEY_CACHE_MAX_OUTPUT)
+    {
+        memcpy (entry->name, name, cbName);
+        memcpy (entry->output, keyStart, cbOutput);
+        entry->cbName = cbName;
+        entry->cbOutput = cbOutput;
+    }
+
+    return TRUE;
+}
+
+/*
+Formats a span of numbers handed over by iterGetBulk. Reserves room for a chunk of elements
+at a time and formats them in a tight loop without any calls back into the implementor */
+
+#define JSON_BULK_CHUNK 256
+#define JSON_BULK_MAX_ELEMENT 64
+
+static int Buffer_AppendBulk (JSOBJ obj, JSONEncodeState *es, int type, const void *values, size_t count)
+{
+    size_t index = 0;
+    size_t chunkEnd;
+
+    while (index < count)
+    {
+        chunkEnd = index + JSON_BULK_CHUNK;
+        if (chunkEnd > count)
+        {
+            chunkEnd = count;
+        }
+
+        Buffer_Reserve(es, (chunkEnd - index) * JSON_BULK_MAX_ELEMENT);
+        if (es->errorMsg)
+        {
+            return FALSE;
+        }
+
+        for (; index < chunkEnd; index ++)
+        {
+            if (index > 0)
+            {
+                Buffer_AppendCharUnchecked (es, ',');
+#ifndef JSON_NO_EXTRA_WHITESPACE
+                Buffer_AppendCharUnchecked (es, ' ');
+#endif
+            }
+
+            if (type == JT_LONG)
+            {
+                Buffer_AppendLongUnchecked (es, ((const JSINT64 *) values)[index]);
+            }
+            else
+            if (!Buffer_AppendDoubleUnchecked (obj, es, ((const double *) values)[index]))
+            {
+                return FALSE;
+            }
+        }
+    }
+
+    return TRUE;
+}
+
+/*
+Returns the number of leading bytes of io which can be output without escaping */
+static size_t Buffer_CountUnescaped (const char *io, const char *end, int asciiOnly)
+{
+    const char *start = io;
+    JSUINT8 chr;
+
+#ifdef JSON_SIMD_WIDTH
+    while (end - io >= JSON_SIMD_WIDTH)
+    {
+        size_t cbSafe = Simd_CopyUnescaped (NULL, io, asciiOnly);
+        io += cbSafe;
+
+        if (cbSafe != JSON_SIMD_WIDTH)
+        {
+            return io - start;
+        }
+    }
+#endif
+
+    while (io < end)
+    {
+        chr = (JSUINT8) *io;
+
+        if (chr < 0x20 || chr == '\"' || chr == '\\' || chr == '/' || (asciiOnly && chr >= 0x80))
+        {
+            break;
+        }
+
+        io ++;
+    }
+
+    return io - start;
+}
+
+/*
+Makes room for count more items in a growable array of JSON_EncodeObjectToIOVec */
+static void *IOVec_Reserve (JSONEncodeState *es, void *items, size_t used, size_t *capacity, size_t count, size_t cbItem)
+{
+    size_t newCapacity;
+
+    if (used + count <= *capacity)
+    {
+        return items;
+    }
+
+    newCapacity = *capacity ? *capacity * 2 : 16;
+    while (newCapacity < used + count)
+    {
+        newCapacity *= 2;
+    }
+
+    items = items ? es->realloc (items, newCapacity * cbItem) : es->malloc (newCapacity * cbItem);
+    if (items)
+    {
+        *capacity = newCapacity;
+    }
+    return items;
+}
+
+/*
+Makes room for count more segments. The first one lives in the JSONIOVec itself so output which
+fits in one segment needs no segment list */
+static JSONSegment *IOVec_ReserveSegments (JSONEncodeState *es, size_t count)
+{
+    JSONIOVec *iovec = es->iovec;
+    JSONSegment *segments;
+
+    if (iovec->capacity == 0)
+    {
+        if (iovec->count + count <= 1)
+        {
+            iovec->segments = &iovec->firstSegment;
+            return iovec->segments;
+        }
+
+        segments = (JSONSegment *) IOVec_Reserve (es, NULL, iovec->count, &iovec->capacity, count, sizeof (JSONSegment));
+        if (segments && iovec->count)
+        {
+            segments[0] = iovec->firstSegment;
+        }
+    }
+    else
+    {
+        segments = (JSONSegment *) IOVec_Reserve (es, iovec->segments, iovec->count, &iovec->capacity, count, sizeof (JSONSegment));
+    }
+
+    if (segments)
+    {
+        iovec->segments = segments;
+    }
+    return segments;
+}
+
+/*
+Ends the current buffered segment. Buffers never move in iovec mode so the segment can point
+straight at its bytes */
+static int IOVec_CutBuffered (JSONEncodeState *es)
+{
+    JSONIOVec *iovec = es->iovec;
+    JSONSegment *segments;
+    size_t cbBuffered = (es->offset - es->start) - iovec->cbAssigned;
+
+    if (cbBuffered == 0)
+    {
+        return TRUE;
+    }
+
+    segments = IOVec_ReserveSegments (es, 1);
+    if (!segments)
+    {
+        return FALSE;
+    }
+
+    segments[iovec->count].base = es->start + iovec->cbAssigned;
+    segments[iovec->count].length = cbBuffered;
+    iovec->count ++;
+    iovec->cbAssigned += cbBuffered;
+    return TRUE;
+}
+
+/*
+Records a heap buffer to be freed by JSON_FreeIOVec */
+static int IOVec_AddBuffer (JSONEncodeState *es, char *buffer)
+{
+    JSONIOVec *iovec = es->iovec;
+    char **buffers;
+
+    buffers = (char **) IOVec_Reserve (es, iovec->buffers, iovec->bufferCount, &iovec->bufferCapacity, 1, sizeof (char *));
+    if (!buffers)
+    {
+        return FALSE;
+    }
+    iovec->buffers = buffers;
+    iovec->buffers[iovec->bufferCount ++] = buffer;
+    return TRUE;
+}
+
+/*
+Buffer_Realloc for iovec mode. Closes the segment in the current buffer and carries on in a new
+one, nothing written so far is moved */
+static void IOVec_NextBuffer (JSONEncodeState *es, size_t cbNeeded)
+{
+    size_t newSize = (es->end - es->start) * 2;
+    char *buffer;
+
+    if (newSize > JSON_IOVEC_MAX_SEGMENT)
+    {
+        newSize = JSON_IOVEC_MAX_SEGMENT;
+    }
+
+    if (newSize < cbNeeded)
+    {
+        newSize = cbNeeded;
+    }
+
+    if (!IOVec_CutBuffered (es))
+    {
+        SetError (NULL, es, "Could not reserve memory block");
+        return;
+    }
+
+    buffer = (char *) es->malloc (newSize);
+    if (!buffer)
+    {
+        SetError (NULL, es, "Could not reserve memory block");
+        return;
+    }
+
+    if (!IOVec_AddBuffer (es, buffer))
+    {
+        es->free (buffer);
+        SetError (NULL, es, "Could not reserve memory block");
+        return;
+    }
+
+    es->heap = 1;
+    es->start = es->offset = es->hashed = buffer;
+    es->end = buffer + newSize;
+    es->iovec->cbAssigned = 0;
+    Memo_Invalidate (es);
+}
+
+/*
+Outputs a string value as a reference to its bytes rather than a copy if it needs no escaping and the
+implementor agrees to hold on to it. Returns FALSE if the string should be encoded as usual */
+static int Buffer_ReferenceString (JSOBJ obj, JSONEncodeState *es, JSONTypeContext *tc, const char *value, size_t cbValue)
+{
+    JSONIOVec *iovec = es->iovec;
+    JSONSegment *segments;
+    JSOBJ *held;
+
+    if (!es->encoder->holdString || Buffer_CountUnescaped (value, value + cbValue, es->encoder->forceASCII) != cbValue)
+    {
+        return FALSE;
+    }
+
+    held = (JSOBJ *) IOVec_Reserve (es, iovec->held, iovec->heldCount, &iovec->heldCapacity, 1, sizeof (JSOBJ));
+    if (!held)
+    {
+        return FALSE;
+    }
+    iovec->held = held;
+
+    /*
+    Room for the buffered segment before the string and the string itself */
+    segments = IOVec_ReserveSegments (es, 2);
+    if (!segments)
+    {
+        return FALSE;
+    }
+
+    if (!es->encoder->holdString (obj, tc))
+    {
+        return FALSE;
+    }
+    held[iovec->heldCount ++] = obj;
+
+    Buffer_AppendCharUnchecked (es, '\"');
+    IOVec_CutBuffered (es);
+    Memo_Invalidate (es);
+
+    Buffer_HashPending (es);
+    if (es->hash)
+    {
+        JSON_HashUpdate (es->hash, value, cbValue);
+    }
+
+    iovec->segments[iovec->count].base = value;
+    iovec->segments[iovec->count].length = cbValue;
+    iovec->count ++;
+
+    Buffer_AppendCharUnchecked (es, '\"');
+    return TRUE;
+}
+
+/*
+Strings are escaped JSON_STRING_CHUNK input bytes at a time so the buffer only ever has to hold the
+worst case escaping of one chunk. Output memory then tracks the size of the output rather than
+JSON_MAX_ESCAPE_RATIO times the size of the largest string, and a stream gets flushed between chunks */
+#define JSON_STRING_CHUNK 65536
+
+static int Buffer_AppendEscapedString (JSOBJ obj, JSONEncodeState *es, const char *value, size_t szlen)
+{
+    const char *end = value + szlen;
+    const char *chunkEnd;
+    int backoff;
+
+    Buffer_Reserve(es, 2);
+    if (es->errorMsg)
+    {
+        return FALSE;
+    }
+    Buffer_AppendCharUnchecked (es, '\"');
+
+    while (value < end)
+    {
+        chunkEnd = (size_t) (end - value) > JSON_STRING_CHUNK ? value + JSON_STRING_CHUNK : end;
+
+        /*
+        Don't split a UTF-8 sequence between two chunks */
+        for (backoff = 0; chunkEnd != end && backoff < 3 && ((JSUINT8) *chunkEnd & 0xc0) == 0x80; backoff ++)
+        {
+            chunkEnd --;
+        }
+
+        Buffer_Reserve(es, ((chunkEnd - value) * JSON_MAX_ESCAPE_RATIO) + 1);
+        if (es->errorMsg)
+        {
+            return FALSE;
+        }
+
+        if (es->encoder->forceASCII)
+        {
+            if (!Buffer_EscapeStringValidated(obj, es, value, chunkEnd))
+            {
+                return FALSE;
+            }
+        }
+        else
+        {
+            if (!Buffer_EscapeStringUnvalidated(es, value, chunkEnd))
+            {
+                return FALSE;
+            }
+        }
+
+        value = chunkEnd;
+    }
+
+    Buffer_AppendCharUnchecked (es, '\"');
+    return TRUE;
+}
+
+#define JSON_MEMO_INITIAL_CAPACITY 64
+
+static FASTCALL_ATTR INLINE_PREFIX JSONMemoEntry * FASTCALL_MSVC Memo_Find (struct __JSONMemo *memo, JSOBJ obj)
+{
+    size_t mask = memo->capacity - 1;
+    size_t index = (((size_t) obj >> 4) * 2654435761U) & mask;
+
+    while (memo->entries[index].obj)
+    {
+        if (memo->entries[index].obj == obj)
+        {
+            return &memo->entries[index];
+        }
+        index = (index + 1) & mask;
+    }
+
+    return NULL;
+}
+
+static int Memo_Grow (JSONEncodeState *es)
+{
+    struct __JSONMemo *memo = es->memo;
+    JSONMemoEntry *oldEntries = memo->entries;
+    size_t oldCapacity = memo->capacity;
+    size_t newCapacity = oldCapacity ? oldCapacity * 2 : JSON_MEMO_INITIAL_CAPACITY;
+    size_t mask = newCapacity - 1;
+    size_t index;
+    size_t slot;
+
+    memo->entries = (JSONMemoEntry *) es->malloc (newCapacity * sizeof (JSONMemoEntry));
+    if (!memo->entries)
+    {
+        memo->entries = oldEntries;
+        return FALSE;
+    }
+    memset (memo->entries, 0, newCapacity * sizeof (JSONMemoEntry));
+    memo->capacity = newCapacity;
+
+    for (index = 0; index < oldCapacity; index ++)
+    {
+        if (oldEntries[index].obj)
+        {
+            slot = (((size_t) oldEntries[index].obj >> 4) * 2654435761U) & mask;
+            while (memo->entries[slot].obj)
+            {
+                slot = (slot + 1) & mask;
+            }
+            memo->entries[slot] = oldEntries[index];
+        }
+    }
+
+    if (oldEntries)
+    {
+        es->free (oldEntries);
+    }
+    return TRUE;
+}
+
+/*
+Returns TRUE if the output of the container obj should be recorded. obj is asked about only the first
+time it's seen, accepted objects stay in the table (and held) even if their output can't be recorded */
+static int Memo_Track (JSONEncodeState *es, JSOBJ obj, JSONTypeContext *tc)
+{
+    struct __JSONMemo *memo = es->memo;
+    JSONMemoEntry *entry;
+
+    if (memo && Memo_Find (memo, obj))
+    {
+        return TRUE;
+    }
+
+    if (!es->encoder->memoize (obj, tc))
+    {
+        return FALSE;
+    }
+
+    if (!memo)
+    {
+        memo = (struct __JSONMemo *) es->malloc (sizeof (struct __JSONMemo));
+        if (!memo)
+        {
+            goto RELEASE;
+        }
+        memset (memo, 0, sizeof (struct __JSONMemo));
+        es->memo = memo;
+    }
+
+    if ((memo->count + 1) * 2 > memo->capacity && !Memo_Grow (es))
+    {
+        goto RELEASE;
+    }
+
+    entry = &memo->entries[(((size_t) obj >> 4) * 2654435761U) & (memo->capacity - 1)];
+    while (entry->obj)
+    {
+        entry = (entry == memo->entries + memo->capacity - 1) ? memo->entries : entry + 1;
+    }
+    entry->obj = obj;
+    entry->length = 0;
+    memo->count ++;
+    return TRUE;
+
+RELEASE:
+    if (es->encoder->releaseObject)
+    {
+        es->encoder->releaseObject (obj);
+    }
+    return FALSE;
+}
+
+static void Memo_Free (JSONEncodeState *es)
+{
+    struct __JSONMemo *memo = es->memo;
+    size_t index;
+
+    if (!memo)
+    {
+        return;
+    }
+
+    for (index = 0; index < memo->capacity; index ++)
+    {
+        if (memo->entries[index].obj && es->encoder->releaseObject)
+        {
+            es->encoder->releaseObject (memo->entries[index].obj);
+        }
+    }
+
+    if (memo->entries)
+    {
+        es->free (memo->entries);
+    }
+    es->free (memo);
+    es->memo = NULL;
+}
+
+static void Encoder_FreeCaches (JSONEncodeState *es)
+{
+    KeyCache_Free (es);
+    Memo_Free (es);
+}
+
+/*
+Containers being encoded are kept on an explicit stack rather than the C stack. The first
+JSON_ENCODE_STACK_INLINE levels live in encode()'s own frame, deeper documents move the
+stack to the heap. This keeps C stack use small and fixed no matter how deep the input is. */
+
+#define JSON_ENCODE_STACK_INLINE 32
+
+typedef struct __JSONEncodeFrame
+{
+    JSOBJ obj;
+    JSONTypeContext tc;
+    int count;
+
+    /* Set if the container's output gets recorded for memoization once it's closed */
+    int memoized;
+    size_t memoOffset;
+    JSUINT32 memoGeneration;
+
+    /* Deepest level reached inside the container, only kept track of when memoizing */
+    int deepest;
+} JSONEncodeFrame;
+
+/*
+Passes the deepest level reached inside a container on to the container holding it */
+#define Encoder_NoteDepth(__stack, __level, __deepest) \
+    if ((__level) > 0 && (__stack)[(__level) - 1].deepest < (__deepest)) \
+    { \
+        (__stack)[(__level) - 1].deepest = (__deepest); \
+    }
+
+
+static JSONEncodeFrame *Encoder_GrowStack (JSONEncodeState *es, JSONEncodeFrame *stack, JSONEncodeFrame *inlineStack, size_t *capacity)
+{
+    JSONEncodeFrame *newStack;
+    size_t newCapacity = *capacity * 2;
+
+    if (stack == inlineStack)
+    {
+        newStack = (JSONEncodeFrame *) es->malloc (newCapacity * sizeof (JSONEncodeFrame));
+        if (newStack)
+        {
+            memcpy (newStack, stack, *capacity * sizeof (JSONEncodeFrame));
+        }
+    }
+    else
+    {
+        newStack = (JSONEncodeFrame *) es->realloc (stack, newCapacity * sizeof (JSONEncodeFrame));
+    }
+
+    if (!newStack)
+    {
+        SetError (NULL, es, "Could not reserve memory block");
+        return NULL;
+    }
+
+    *capacity = newCapacity;
+    return newStack;
+}
+
+/*
+Fills value from a type context beginTypeContext has set up, using the separate get*Value callbacks.
+Scalars other than strings are read and their context ended right away */
+static FASTCALL_ATTR INLINE_PREFIX void FASTCALL_MSVC Encoder_ReadValue (JSOBJ obj, JSONEncodeState *es, JSONTypeContext *tc, JSONValue *value)
+{
+    value->endContext = 0;
+
+    switch (tc->type)
+    {
+        case JT_INVALID:
+        case JT_ARRAY:
+        case JT_OBJECT:
+            return;
+
+        case JT_LONG:
+            value->longValue = es->encoder->getLongValue(obj, tc);
+            break;
+
+        case JT_INT:
+            value->longValue = es->encoder->getIntValue(obj, tc);
+            break;
+
+        case JT_DOUBLE:
+            value->doubleValue = es->encoder->getDoubleValue(obj, tc);
+            break;
+
+        case JT_DECIMAL:
+            value->longValue = es->encoder->getDecimalValue(obj, tc, &value->scale);
+            break;
+
+        case JT_UTF8:
+        case JT_RAW:
+            value->stringValue = es->encoder->getStringValue(obj, tc, &value->cbString);
+            value->endContext = 1;
+            return;
+    }
+
+    es->encoder->endTypeContext(obj, tc);
+}
+
+/*
+Fills value the way a getValue callback would, using beginTypeContext and Encoder_ReadValue */
+static FASTCALL_ATTR INLINE_PREFIX void FASTCALL_MSVC Encoder_GetValue (JSOBJ obj, JSONEncodeState *es, JSONTypeContext *tc, JSONValue *value)
+{
+    if (es->encoder->getValue)
+    {
+        value->endContext = 0;
+        es->encoder->getValue(obj, tc, value);
+        return;
+    }
+
+    es->encoder->beginTypeContext(obj, tc);
+    Encoder_ReadValue (obj, es, tc, value);
+}
+
+/*
+Writes a scalar as filled in by Encoder_GetValue. Room for anything but strings, raw JSON and decimals
+must have been made already. Returns FALSE on error */
+static FASTCALL_ATTR INLINE_PREFIX int FASTCALL_MSVC Buffer_AppendScalar (JSOBJ obj, JSONEncodeState *es, JSONTypeContext *tc, const JSONValue *jsonValue)
+{
+    switch (tc->type)
+    {
+        case JT_LONG:
+        {
+            Buffer_AppendLongUnchecked (es, jsonValue->longValue);
+            break;
+        }
+
+        case JT_INT:
+        {
+            Buffer_AppendIntUnchecked (es, (JSINT32) jsonValue->longValue);
+            break;
+        }
+
+        case JT_TRUE:
+        {
+            Buffer_AppendCharUnchecked (es, 't');
+            Buffer_AppendCharUnchecked (es, 'r');
+            Buffer_AppendCharUnchecked (es, 'u');
+            Buffer_AppendCharUnchecked (es, 'e');
+            break;
+        }
+
+        case JT_FALSE:
+        {
+            Buffer_AppendCharUnchecked (es, 'f');
+            Buffer_AppendCharUnchecked (es, 'a');
+            Buffer_AppendCharUnchecked (es, 'l');
+            Buffer_AppendCharUnchecked (es, 's');
+            Buffer_AppendCharUnchecked (es, 'e');
+            break;
+        }
+
+        case JT_NULL:
+        {
+            Buffer_AppendCharUnchecked (es, 'n');
+            Buffer_AppendCharUnchecked (es, 'u');
+            Buffer_AppendCharUnchecked (es, 'l');
+            Buffer_AppendCharUnchecked (es, 'l');
+            break;
+        }
+
+        case JT_DOUBLE:
+        {
+            return Buffer_AppendDoubleUnchecked (obj, es, jsonValue->doubleValue);
+        }
+
+        case JT_DECIMAL:
+        {
+            return Buffer_AppendDecimal (obj, es, jsonValue->longValue, jsonValue->scale);
+        }
+
+        case JT_UTF8:
+        {
+            if (es->iovec && jsonValue->cbString >= es->iovec->minReference && Buffer_ReferenceString (obj, es, tc, jsonValue->stringValue, jsonValue->cbString))
+            {
+                break;
+            }
+
+            return Buffer_AppendEscapedString (obj, es, jsonValue->stringValue, jsonValue->cbString);
+        }
+
+        case JT_RAW:
+        {
+            Buffer_Reserve(es, jsonValue->cbString);
+            if (es->errorMsg)
+            {
+                return FALSE;
+            }
+            memcpy (es->offset, jsonValue->stringValue, jsonValue->cbString);
+            es->offset += jsonValue->cbString;
+            break;
+        }
+    }
+
+    return TRUE;
+}
+
+/*
+Makes room for a whole container at once when its size is known, so large containers don't grow the
+output a piece at a time. Runs before any of the container is written so a memoized container can
+simply start over at the new offset. Not used when streaming, where it would only delay flushing */
+static int Buffer_ReserveContainer (JSOBJ obj, JSONEncodeState *es, JSONEncodeFrame *frame)
+{
+    size_t count = es->encoder->iterSizeHint(obj, &frame->tc);
+    size_t cbReserve;
+
+    if (count == 0)
+    {
+        return TRUE;
+    }
+
+    cbReserve = JSON_SIZE_HINT_MAX_RESERVE;
+    if (count < JSON_SIZE_HINT_MAX_RESERVE / JSON_SIZE_HINT_ITEM_BYTES)
+    {
+        cbReserve = (count * JSON_SIZE_HINT_ITEM_BYTES) + 2;
+    }
+
+    Buffer_Reserve (es, cbReserve);
+    if (es->errorMsg)
+    {
+        return FALSE;
+    }
+
+    if (frame->memoized)
+    {
+        frame->memoOffset = es->offset - es->start;
+        frame->memoGeneration = es->memo->generation;
+    }
+    return TRUE;
+}
+
+/*
+FIXME:
+Handle integration functions returning NULL here */
+
+/*
+FIXME:
+Perhaps implement recursion detection */
+
+void encode(JSOBJ obj, JSONEncodeState *es, const char *name, size_t cbName)
+{
+    JSONEncodeFrame inlineStack[JSON_ENCODE_STACK_INLINE];
+    JSONEncodeFrame *stack = inlineStack;
+    JSONEncodeFrame *newStack;
+    JSONEncodeFrame *frame;
+    size_t capacity = JSON_ENCODE_STACK_INLINE;
+    const void *bulkValues;
+    size_t bulkCount;
+    int bulkType;
+    JSONValue jsonValue;
+    JSONMemoEntry *memoEntry;
+    size_t valueOffset;
+
+    es->level = 0;
+
+    for (;;)
+    {
+        if (es->level > es->recursionMax)
+        {
+            SetError (obj, es, "Maximum recursion level reached");
+            goto UNWIND;
+        }
+
+        if ((size_t) es->level >= capacity)
+        {
+            newStack = Encoder_GrowStack (es, stack, inlineStack, &capacity);
+            if (!newStack)
+            {
+                goto UNWIND;
+            }
+            stack = newStack;
+        }
+
+        frame = &stack[es->level];
+
+        if (es->hash && (size_t) (es->offset - es->hashed) >= JSON_HASH_CHUNK)
+        {
+            Buffer_HashPending (es);
+        }
+
+        /*
+        This reservation must hold 
+
+        length of _name as encoded worst case +
+        maxLength of double to string OR maxLength of JSLONG to string
+
+        Since input is assumed to be UTF-8 the worst character length is:
+
+        1 byte (control character) => "\u00XX" (6 bytes)
+        4 bytes (of UTF-8) => "\uXXXX\uXXXX" (12 bytes)
+        */
+
+        Buffer_Reserve(es, 256 + (cbName * JSON_MAX_ESCAPE_RATIO));
+        if (es->errorMsg)
+        {
+            goto UNWIND;
+        }
+
+        if (name)
+        {
+            if (!Buffer_AppendKeyUnchecked(obj, es, name, cbName))
+            {
+                goto UNWIND;
+            }
+        }
+
+        if (es->memo)
+        {
+            memoEntry = Memo_Find (es->memo, obj);
+
+            if (memoEntry && memoEntry->length > 0 && memoEntry->generation == es->memo->generation &&
+                es->level + memoEntry->depth <= es->recursionMax)
+            {
+                Buffer_Reserve (es, memoEntry->length);
+                if (es->errorMsg)
+                {
+                    goto UNWIND;
+                }
+
+                /*
+                Making room may have flushed the earlier output */
+                if (memoEntry->generation == es->memo->generation)
+                {
+                    memcpy (es->offset, es->start + memoEntry->offset, memoEntry->length);
+                    es->offset += memoEntry->length;
+                    Encoder_NoteDepth (stack, es->level, es->level + memoEntry->depth);
+                    goto NEXT_VALUE;
+                }
+            }
+        }
+
+        valueOffset = es->offset - es->start;
+
+        frame->tc.encoder = es->encoder;
+        Encoder_GetValue (obj, es, &frame->tc, &jsonValue);
+
+        frame->memoized = FALSE;
+        if (es->encoder->memoize)
+        {
+            frame->deepest = es->level;
+            Encoder_NoteDepth (stack, es->level, es->level);
+        }
+
+        if (es->encoder->memoize && (frame->tc.type == JT_ARRAY || frame->tc.type == JT_OBJECT) && Memo_Track (es, obj, &frame->tc))
+        {
+            frame->memoized = TRUE;
+            frame->memoOffset = valueOffset;
+            frame->memoGeneration = es->memo->generation;
+        }
+
+        switch (frame->tc.type)
+        {
+            case JT_INVALID:
+            {
+                SetError (obj, es, "Unable to encode object");
+                goto UNWIND;
+            }
+
+            case JT_ARRAY:
+            {
+                frame->obj = obj;
+                frame->count = 0;
+
+                if (es->encoder->iterSizeHint && !es->write && !Buffer_ReserveContainer (obj, es, frame))
+                {
+                    es->encoder->endTypeContext(obj, &frame->tc);
+                    goto UNWIND;
+                }
+
+                es->encoder->iterBegin(obj, &frame->tc);
+
+                Buffer_AppendCharUnchecked (es, '[');
+
+                if (es->encoder->iterGetBulk)
+                {
+                    bulkType = es->encoder->iterGetBulk(obj, &frame->tc, &bulkValues, &bulkCount);
+
+                    if (bulkType == JT_LONG || bulkType == JT_DOUBLE)
+                    {
+                        es->level ++;
+
+                        if (!Buffer_AppendBulk (obj, es, bulkType, bulkValues, bulkCount))
+                        {
+                            goto UNWIND;
+                        }
+
+                        /*
+                        Nothing left to iterate, the array gets closed below */
+                        frame->count = -1;
+                        break;
+                    }
+                }
+
+                es->level ++;
+                break;
+            }
+
+            case JT_OBJECT:
+            {
+                frame->obj = obj;
+                frame->count = 0;
+
+                if (es->encoder->iterSizeHint && !es->write && !Buffer_ReserveContainer (obj, es, frame))
+                {
+                    es->encoder->endTypeContext(obj, &frame->tc);
+                    goto UNWIND;
+                }
+
+                es->encoder->iterBegin(obj, &frame->tc);
+
+                Buffer_AppendCharUnchecked (es, '{');
+                es->level ++;
+                break;
+            }
+
+            default:
+            {
+                if (!Buffer_AppendScalar (obj, es, &frame->tc, &jsonValue))
+                {
+                    goto END_SCALAR_UNWIND;
+                }
+                break;
+            }
+        }
+
+        if (jsonValue.endContext)
+        {
+            es->encoder->endTypeContext(obj, &frame->tc);
+        }
+
+NEXT_VALUE:
+        /*
+        Find the next value to encode, closing every container that has run out of items on the way */
+        for (;;)
+        {
+            if (es->level == 0)
+            {
+                goto DONE;
+            }
+
+            frame = &stack[es->level - 1];
+
+            if (frame->count >= 0 && es->encoder->iterNext(frame->obj, &frame->tc))
+            {
+                if (frame->count > 0)
+                {
+                    Buffer_Reserve (es, 2);
+                    if (es->errorMsg)
+                    {
+                        goto UNWIND;
+                    }
+                    Buffer_AppendCharUnchecked (es, ',');
+#ifndef JSON_NO_EXTRA_WHITESPACE
+                    Buffer_AppendCharUnchecked (es, ' ');
+#endif
+                }
+
+                frame->count ++;
+                obj = es->encoder->iterGetValue(frame->obj, &frame->tc);
+
+                if (frame->tc.type == JT_OBJECT)
+                {
+                    name = es->encoder->iterGetName(frame->obj, &frame->tc, &cbName);
+                }
+                else
+                {
+                    name = NULL;
+                    cbName = 0;
+                }
+                break;
+            }
+
+            es->encoder->iterEnd(frame->obj, &frame->tc);
+            Buffer_Reserve (es, 2);
+            if (!es->errorMsg)
+            {
+                Buffer_AppendCharUnchecked (es, frame->tc.type == JT_ARRAY ? ']' : '}');
+
+                if (frame->memoized && frame->memoGeneration == es->memo->generation)
+                {
+                    memoEntry = Memo_Find (es->memo, frame->obj);
+                    memoEntry->offset = frame->memoOffset;
+                    memoEntry->length = (es->offset - es->start) - frame->memoOffset;
+                    memoEntry->generation = frame->memoGeneration;
+                    memoEntry->depth = frame->deepest - (es->level - 1);
+                }
+            }
+
+            if (es->encoder->memoize)
+            {
+                Encoder_NoteDepth (stack, es->level - 1, frame->deepest);
+            }
+            es->encoder->endTypeContext(frame->obj, &frame->tc);
+            es->level --;
+
+            if (es->errorMsg)
+            {
+                goto UNWIND;
+            }
+        }
+    }
+
+END_SCALAR_UNWIND:
+    if (jsonValue.endContext)
+    {
+        es->encoder->endTypeContext(obj, &frame->tc);
+    }
+
+UNWIND:
+    while (es->level > 0)
+    {
+        frame = &stack[-- es->level];
+        es->encoder->iterEnd(frame->obj, &frame->tc);
+        es->encoder->endTypeContext(frame->obj, &frame->tc);
+    }
+
+DONE:
+    if (stack != inlineStack)
+    {
+        es->free (stack);
+    }
+}
+
+/*
+Prepares es for a call with enc, everything but es->hash is reset */
+static void Encoder_Reset(const JSONObjectEncoder *enc, JSONEncodeState *es)
+{
+    es->encoder = enc;
+    es->malloc = enc->malloc ? enc->malloc : malloc;
+    es->free =  enc->free ? enc->free : free;
+    es->realloc = enc->realloc ? enc->realloc : realloc;
+    es->errorMsg = NULL;
+    es->errorObj = NULL;
+    es->start = es->offset = es->end = es->hashed = NULL;
+    es->heap = 0;
+    es->level = 0;
+    es->write = NULL;
+    es->writeContext = NULL;
+    es->keyCache = NULL;
+    es->keyCount = 0;
+    es->memo = NULL;
+    es->iovec = NULL;
+    es->tmpl = NULL;
+    es->tmplHole = 0;
+
+    es->recursionMax = enc->recursionMax;
+    if (es->recursionMax < 1)
+    {
+        es->recursionMax = JSON_MAX_RECURSION_DEPTH;
+    }
+
+    es->doublePrecision = enc->doublePrecision;
+    if (es->doublePrecision < 0 ||
+            es->doublePrecision > JSON_DOUBLE_MAX_DECIMALS)
+    {
+        es->doublePrecision = JSON_DOUBLE_MAX_DECIMALS;
+    }
+}
+
+/*
+Runs a WithState function on behalf of a function taking a non const encoder */
+#define Encoder_BeginLegacy(__enc, __es) \
+    (__es)->hash = (__enc)->hash;
+
+#define Encoder_EndLegacy(__enc, __es) \
+    (__enc)->errorMsg = (__es)->errorMsg; \
+    (__enc)->errorObj = (__es)->errorObj;
+
+static int Encoder_Begin(JSOBJ obj, JSONEncodeState *es, char *_buffer, size_t _cbBuffer)
+{
+    if (_buffer == NULL)
+    {
+        /*
+        Not sized from the output size estimate, the buffer is handed to the caller and small outputs
+        shouldn't come back in a block sized for large ones. Buffer_Realloc jumps to the estimate instead */
+        _cbBuffer = 32768;
+        es->start = (char *) es->malloc (_cbBuffer);
+        if (!es->start)
+        {
+            SetError(obj, es, "Could not reserve memory block");
+            return FALSE;
+        }
+        es->heap = 1;
+    }
+    else
+    {
+        es->start = _buffer;
+        es->heap = 0;
+    }
+
+    es->end = es->start + _cbBuffer;
+    es->offset = es->hashed = es->start;
+    return TRUE;
+}
+
+char *JSON_EncodeObjectWithState(JSOBJ obj, const JSONObjectEncoder *enc, JSONEncodeState *es, char *_buffer, size_t _cbBuffer)
+{
+    Encoder_Reset (enc, es);
+
+    if (!Encoder_Begin(obj, es, _buffer, _cbBuffer))
+    {
+        return NULL;
+    }
+
+    encode (obj, es, NULL, 0);
+    Encoder_FreeCaches (es);
+    Buffer_HashPending (es);
+
+    Buffer_Reserve(es, 1);
+    if (es->errorMsg)
+    {
+        if (es->heap)
+        {
+            es->free (es->start);
+        }
+        return NULL;
+    }
+    Buffer_AppendCharUnchecked(es, '\0');
+
+    Buffer_UpdateSizeEstimate (es->offset - es->start);
+    return es->start;
+}
+
+char *JSON_EncodeObject(JSOBJ obj, JSONObjectEncoder *enc, char *_buffer, size_t _cbBuffer)
+{
+    JSONEncodeState es;
+    char *ret;
+
+    Encoder_BeginLegacy (enc, &es);
+    ret = JSON_EncodeObjectWithState (obj, enc, &es, _buffer, _cbBuffer);
+    Encoder_EndLegacy (enc, &es);
+    return ret;
+}
+
+char *JSON_EncodeBatchWithState(JSOBJ *objs, size_t n, const JSONObjectEncoder *enc, JSONEncodeState *es, const char *separator, size_t cbSeparator, size_t *offsets, char *_buffer, size_t _cbBuffer)
+{
+    size_t index;
+
+    Encoder_Reset (enc, es);
+
+    if (!Encoder_Begin(n > 0 ? objs[0] : NULL, es, _buffer, _cbBuffer))
+    {
+        return NULL;
+    }
+
+    for (index = 0; index < n; index ++)
+    {
+        offsets[index] = es->offset - es->start;
+
+        es->level = 0;
+        encode (objs[index], es, NULL, 0);
+
+        Buffer_Reserve(es, cbSeparator);
+        if (es->errorMsg)
+        {
+            break;
+        }
+        if (cbSeparator > 0)
+        {
+            memcpy (es->offset, separator, cbSeparator);
+            es->offset += cbSeparator;
+        }
+    }
+
+    Encoder_FreeCaches (es);
+    Buffer_HashPending (es);
+
+    Buffer_Reserve(es, 1);
+    if (es->errorMsg)
+    {
+        if (es->heap)
+        {
+            es->free (es->start);
+        }
+        return NULL;
+    }
+
+    offsets[n] = es->offset - es->start;
+    Buffer_AppendCharUnchecked(es, '\0');
+
+    Buffer_UpdateSizeEstimate (es->offset - es->start);
+    return es->start;
+}
+
+char *JSON_EncodeBatch(JSOBJ *objs, size_t n, JSONObjectEncoder *enc, const char *separator, size_t cbSeparator, size_t *offsets, char *_buffer, size_t _cbBuffer)
+{
+    JSONEncodeState es;
+    char *ret;
+
+    Encoder_BeginLegacy (enc, &es);
+    ret = JSON_EncodeBatchWithState (objs, n, enc, &es, separator, cbSeparator, offsets, _buffer, _cbBuffer);
+    Encoder_EndLegacy (enc, &es);
+    return ret;
+}
+
+int JSON_EncodeObjectToStreamWithState(JSOBJ obj, const JSONObjectEncoder *enc, JSONEncodeState *es, JSPFN_WRITE write, void *writeContext, char *_buffer, size_t _cbBuffer)
+{
+    Encoder_Reset (enc, es);
+    es->write = write;
+    es->writeContext = writeContext;
+
+    if (!Encoder_Begin(obj, es, _buffer, _cbBuffer))
+    {
+        return FALSE;
+    }
+
+    encode (obj, es, NULL, 0);
+    Encoder_FreeCaches (es);
+    Buffer_Flush (es);
+
+    if (es->heap)
+    {
+        es->free (es->start);
+    }
+
+    es->start = es->offset = es->end = NULL;
+    es->write = NULL;
+    es->writeContext = NULL;
+
+    return es->errorMsg ? FALSE : TRUE;
+}
+
+int JSON_EncodeObjectToStream(JSOBJ obj, JSONObjectEncoder *enc, JSPFN_WRITE write, void *writeContext, char *_buffer, size_t _cbBuffer)
+{
+    JSONEncodeState es;
+    int ret;
+
+    Encoder_BeginLegacy (enc, &es);
+    ret = JSON_EncodeObjectToStreamWithState (obj, enc, &es, write, writeContext, _buffer, _cbBuffer);
+    Encoder_EndLegacy (enc, &es);
+    return ret;
+}
+
+#ifdef JSON_WITH_ZLIB
+
+/*
+Deflate output, sits between the encoder's stream output and the caller's write function.
+Each chunk flushed by the encoder is compressed right away so only compressed output leaves the encoder */
+
+#define JSON_DEFLATE_CHUNK 16384
+
+typedef struct __JSONDeflateStream
+{
+    z_stream stream;
+    JSPFN_WRITE write;
+    void *writeContext;
+    unsigned char output[JSON_DEFLATE_CHUNK];
+} JSONDeflateStream;
+
+static int Deflate_Pump (JSONDeflateStream *ds, int flush)
+{
+    size_t cbOutput;
+
+    do
+    {
+        ds->stream.next_out = ds->output;
+        ds->stream.avail_out = JSON_DEFLATE_CHUNK;
+
+        if (deflate (&ds->stream, flush) == Z_STREAM_ERROR)
+        {
+            return FALSE;
+        }
+
+        cbOutput = JSON_DEFLATE_CHUNK - ds->stream.avail_out;
+
+        if (cbOutput > 0 && ds->write (ds->writeContext, (const char *) ds->output, cbOutput) != cbOutput)
+        {
+            return FALSE;
+        }
+    }
+    while (ds->stream.avail_out == 0);
+
+    return TRUE;
+}
+
+static size_t Deflate_Write (void *context, const char *buffer, size_t cbBuffer)
+{
+    JSONDeflateStream *ds = (JSONDeflateStream *) context;
+    size_t cbLeft = cbBuffer;
+    uInt cbSlice;
+
+    /*
+    avail_in is only an uInt */
+    while (cbLeft > 0)
+    {
+        cbSlice = (uInt) (cbLeft < 0x40000000 ? cbLeft : 0x40000000);
+        ds->stream.next_in = (Bytef *) buffer;
+        ds->stream.avail_in = cbSlice;
+
+        if (!Deflate_Pump (ds, Z_NO_FLUSH))
+        {
+            return 0;
+        }
+
+        buffer += cbSlice;
+        cbLeft -= cbSlice;
+    }
+
+    return cbBuffer;
+}
+
+int JSON_EncodeObjectToDeflate(JSOBJ obj, JSONObjectEncoder *enc, int level, int windowBits, JSPFN_WRITE write, void *writeContext, char *_buffer, size_t _cbBuffer)
+{
+    JSONDeflateStream ds;
+    int result;
+
+    memset (&ds.stream, 0, sizeof (z_stream));
+    ds.write = write;
+    ds.writeContext = writeContext;
+
+    if (deflateInit2 (&ds.stream, level, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        enc->errorMsg = "Could not initialize deflate stream";
+        enc->errorObj = obj;
+        return FALSE;
+    }
+
+    result = JSON_EncodeObjectToStream (obj, enc, Deflate_Write, &ds, _buffer, _cbBuffer);
+
+    if (result && !Deflate_Pump (&ds, Z_FINISH))
+    {
+        enc->errorMsg = "Could not write to output stream";
+        enc->errorObj = obj;
+        result = FALSE;
+    }
+
+    deflateEnd (&ds.stream);
+    return result;
+}
+
+#endif
+
+int JSON_EncodeObjectToIOVecWithState(JSOBJ obj, const JSONObjectEncoder *enc, JSONEncodeState *es, size_t minReference, JSONIOVec *iovec, char *_buffer, size_t _cbBuffer)
+{
+    memset (iovec, 0, sizeof (JSONIOVec));
+    iovec->minReference = minReference ? minReference : JSON_IOVEC_MIN_REFERENCE;
+
+    Encoder_Reset (enc, es);
+    es->iovec = iovec;
+
+    if (!Encoder_Begin(obj, es, _buffer, _cbBuffer))
+    {
+        es->iovec = NULL;
+        return FALSE;
+    }
+
+    if (es->heap && !IOVec_AddBuffer (es, es->start))
+    {
+        es->free (es->start);
+        SetError (obj, es, "Could not reserve memory block");
+    }
+    else
+    {
+        encode (obj, es, NULL, 0);
+    }
+    Encoder_FreeCaches (es);
+    Buffer_HashPending (es);
+
+    if (!es->errorMsg && !IOVec_CutBuffered (es))
+    {
+        SetError (obj, es, "Could not reserve memory block");
+    }
+
+    es->iovec = NULL;
+    es->start = es->offset = es->end = NULL;
+
+    if (es->errorMsg)
+    {
+        JSON_FreeIOVec (enc, iovec);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+int JSON_EncodeObjectToIOVec(JSOBJ obj, JSONObjectEncoder *enc, size_t minReference, JSONIOVec *iovec, char *_buffer, size_t _cbBuffer)
+{
+    JSONEncodeState es;
+    int ret;
+
+    Encoder_BeginLegacy (enc, &es);
+    ret = JSON_EncodeObjectToIOVecWithState (obj, enc, &es, minReference, iovec, _buffer, _cbBuffer);
+    Encoder_EndLegacy (enc, &es);
+    return ret;
+}
+
+void JSON_FreeIOVec(const JSONObjectEncoder *enc, JSONIOVec *iovec)
+{
+    JSPFN_FREE pfnFree = enc->free ? enc->free : free;
+    size_t index;
+
+    if (enc->releaseObject)
+    {
+        for (index = 0; index < iovec->heldCount; index ++)
+        {
+            enc->releaseObject (iovec->held[index]);
+        }
+    }
+
+    for (index = 0; index < iovec->bufferCount; index ++)
+    {
+        pfnFree (iovec->buffers[index]);
+    }
+
+    if (iovec->buffers)
+    {
+        pfnFree (iovec->buffers);
+    }
+
+    if (iovec->segments && iovec->segments != &iovec->firstSegment)
+    {
+        pfnFree (iovec->segments);
+    }
+
+    if (iovec->held)
+    {
+        pfnFree (iovec->held);
+    }
+
+    memset (iovec, 0, sizeof (JSONIOVec));
+}
+
+/*
+Templates. The skeleton is split once into the literals between holes, so filling one is a memcpy per
+literal plus the formatting of each bound value. Room for all literals and a typical number per hole
+is reserved up front, so templates with numeric holes only never grow the buffer mid way */
+
+#define JSON_TEMPLATE_HOLE_ESTIMATE 32
+
+/*
+Largest output of a number hole, see Buffer_AppendDoubleUnchecked */
+#define JSON_TEMPLATE_MAX_NUMBER 64
+
+typedef struct __JSONTemplateHoleName
+{
+    const char *name;
+    size_t cbName;
+    int hole;
+} JSONTemplateHoleName;
+
+static const JSONTemplateHoleName g_templateHoles[] =
+{
+    { "int", 3, JTH_LONG },
+    { "double", 6, JTH_DOUBLE },
+    { "str", 3, JTH_UTF8 },
+    { "raw", 3, JTH_RAW },
+    { "value", 5, JTH_OBJECT },
+    { NULL, 0, JTH_END },
+};
+
+static int Template_HoleType (const char *name, size_t cbName)
+{
+    const JSONTemplateHoleName *entry;
+
+    for (entry = g_templateHoles; entry->name; entry ++)
+    {
+        if (entry->cbName == cbName && memcmp (entry->name, name, cbName) == 0)
+        {
+            return entry->hole;
+        }
+    }
+
+    return JTH_END;
+}
+
+int JSON_CompileTemplate(JSONObjectEncoder *enc, JSONTemplate *tmpl, const char *text, size_t cbText)
+{
+    const char *io = text;
+    const char *end = text + cbText;
+    const char *nameEnd;
+    char *of;
+    char *literal;
+    size_t maxHoles = 0;
+    int inString = 0;
+    int hole;
+    JSPFN_MALLOC pfnMalloc = enc->malloc ? enc->malloc : malloc;
+
+    memset (tmpl, 0, sizeof (JSONTemplate));
+    enc->errorMsg = NULL;
+    enc->errorObj = NULL;
+
+    for (; io < end; io ++)
+    {
+        if (*io == '<')
+        {
+            maxHoles ++;
+        }
+    }
+
+    tmpl->chunks = (JSONTemplateChunk *) pfnMalloc ((maxHoles + 1) * sizeof (JSONTemplateChunk));
+    tmpl->text = (char *) pfnMalloc (cbText + 1);
+    if (!tmpl->chunks || !tmpl->text)
+    {
+        enc->errorMsg = "Could not reserve memory block";
+        JSON_FreeTemplate (enc, tmpl);
+        return FALSE;
+    }
+
+    of = literal = tmpl->text;
+
+    for (io = text; io < end; )
+    {
+        if (inString)
+        {
+            if (*io == '\\' && io + 1 < end)
+            {
+                *(of++) = *(io++);
+            }
+            else
+            if (*io == '\"')
+            {
+                inString = 0;
+            }
+            *(of++) = *(io++);
+            continue;
+        }
+
+        if (*io == '<')
+        {
+            nameEnd = (const char *) memchr (io + 1, '>', end - io - 1);
+            hole = nameEnd ? Template_HoleType (io + 1, nameEnd - io - 1) : JTH_END;
+
+            if (hole == JTH_END)
+            {
+                enc->errorMsg = "Invalid hole in template, expected <int>, <double>, <str>, <raw> or <value>";
+                JSON_FreeTemplate (enc, tmpl);
+                return FALSE;
+            }
+
+            tmpl->chunks[tmpl->holeCount].literal = literal;
+            tmpl->chunks[tmpl->holeCount].cbLiteral = of - literal;
+            tmpl->chunks[tmpl->holeCount].hole = hole;
+            tmpl->holeCount ++;
+
+            literal = of;
+            io = nameEnd + 1;
+            continue;
+        }
+
+        if (*io == '\"')
+        {
+            inString = 1;
+        }
+        *(of++) = *(io++);
+    }
+
+    if (inString)
+    {
+        enc->errorMsg = "Unterminated string in template";
+        JSON_FreeTemplate (enc, tmpl);
+        return FALSE;
+    }
+
+    tmpl->chunks[tmpl->holeCount].literal = literal;
+    tmpl->chunks[tmpl->holeCount].cbLiteral = of - literal;
+    tmpl->chunks[tmpl->holeCount].hole = JTH_END;
+    tmpl->cbLiterals = of - tmpl->text;
+    return TRUE;
+}
+
+void JSON_FreeTemplate(const JSONObjectEncoder *enc, JSONTemplate *tmpl)
+{
+    JSPFN_FREE pfnFree = enc->free ? enc->free : free;
+
+    if (tmpl->chunks)
+    {
+        pfnFree (tmpl->chunks);
+    }
+
+    if (tmpl->text)
+    {
+        pfnFree (tmpl->text);
+    }
+
+    memset (tmpl, 0, sizeof (JSONTemplate));
+}
+
+static FASTCALL_ATTR INLINE_PREFIX void FASTCALL_MSVC Template_AppendLiteral (JSONEncodeState *es, const JSONTemplateChunk *chunk)
+{
+    Buffer_Reserve(es, chunk->cbLiteral);
+    if (es->errorMsg)
+    {
+        return;
+    }
+    memcpy (es->offset, chunk->literal, chunk->cbLiteral);
+    es->offset += chunk->cbLiteral;
+}
+
+/*
+Checks that the next hole exists and is of the given type */
+static int Template_BeginHole (JSONEncodeState *es, int hole)
+{
+    if (!es->tmpl || es->errorMsg)
+    {
+        return FALSE;
+    }
+
+    if (es->tmplHole >= es->tmpl->holeCount)
+    {
+        SetError (NULL, es, "More values than template holes");
+        return FALSE;
+    }
+
+    if (es->tmpl->chunks[es->tmplHole].hole != hole)
+    {
+        SetError (NULL, es, "Value doesn't match the type of the template hole");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+Writes the literal following the hole just filled */
+static int Template_EndHole (JSONEncodeState *es)
+{
+    if (es->errorMsg)
+    {
+        return FALSE;
+    }
+
+    es->tmplHole ++;
+    Template_AppendLiteral (es, &es->tmpl->chunks[es->tmplHole]);
+    return es->errorMsg ? FALSE : TRUE;
+}
+
+int JSON_TemplateBegin(const JSONObjectEncoder *enc, JSONEncodeState *es, const JSONTemplate *tmpl, char *_buffer, size_t _cbBuffer)
+{
+    Encoder_Reset (enc, es);
+
+    if (!Encoder_Begin(NULL, es, _buffer, _cbBuffer))
+    {
+        return FALSE;
+    }
+
+    es->tmpl = tmpl;
+    es->tmplHole = 0;
+
+    Buffer_Reserve(es, tmpl->cbLiterals + tmpl->holeCount * JSON_TEMPLATE_HOLE_ESTIMATE + 1);
+    if (es->errorMsg)
+    {
+        return FALSE;
+    }
+
+    Template_AppendLiteral (es, &tmpl->chunks[0]);
+    return es->errorMsg ? FALSE : TRUE;
+}
+
+int JSON_TemplateBindLong(JSONEncodeState *es, JSINT64 value)
+{
+    if (!Template_BeginHole (es, JTH_LONG))
+    {
+        return FALSE;
+    }
+
+    Buffer_Reserve(es, JSON_TEMPLATE_MAX_NUMBER);
+    if (es->errorMsg)
+    {
+        return FALSE;
+    }
+    Buffer_AppendLongUnchecked (es, value);
+    return Template_EndHole (es);
+}
+
+int JSON_TemplateBindDouble(JSONEncodeState *es, double value)
+{
+    if (!Template_BeginHole (es, JTH_DOUBLE))
+    {
+        return FALSE;
+    }
+
+    Buffer_Reserve(es, JSON_TEMPLATE_MAX_NUMBER);
+    if (es->errorMsg || !Buffer_AppendDoubleUnchecked (NULL, es, value))
+    {
+        return FALSE;
+    }
+    return Template_EndHole (es);
+}
+
+int JSON_TemplateBindString(JSONEncodeState *es, const char *value, size_t cbValue)
+{
+    if (!Template_BeginHole (es, JTH_UTF8) || !Buffer_AppendEscapedString (NULL, es, value, cbValue))
+    {
+        return FALSE;
+    }
+    return Template_EndHole (es);
+}
+
+int JSON_TemplateBindRaw(JSONEncodeState *es, const char *value, size_t cbValue)
+{
+    if (!Template_BeginHole (es, JTH_RAW))
+    {
+        return FALSE;
+    }
+
+    Buffer_Reserve(es, cbValue);
+    if (es->errorMsg)
+    {
+        return FALSE;
+    }
+    memcpy (es->offset, value, cbValue);
+    es->offset += cbValue;
+    return Template_EndHole (es);
+}
+
+int JSON_TemplateBindObject(JSONEncodeState *es, JSOBJ obj)
+{
+    if (!Template_BeginHole (es, JTH_OBJECT))
+    {
+        return FALSE;
+    }
+
+    encode (obj, es, NULL, 0);
+    return Template_EndHole (es);
+}
+
+char *JSON_TemplateEnd(JSONEncodeState *es, size_t *cbOutput)
+{
+    if (!es->tmpl)
+    {
+        return NULL;
+    }
+
+    if (!es->errorMsg && es->tmplHole < es->tmpl->holeCount)
+    {
+        SetError (NULL, es, "Fewer values than template holes");
+    }
+
+    es->tmpl = NULL;
+    Encoder_FreeCaches (es);
+    Buffer_HashPending (es);
+
+    Buffer_Reserve(es, 1);
+    if (es->errorMsg)
+    {
+        if (es->heap)
+        {
+            es->free (es->start);
+        }
+        return NULL;
+    }
+    Buffer_AppendCharUnchecked(es, '\0');
+
+    if (cbOutput)
+    {
+        *cbOutput = es->offset - es->start - 1;
+    }
+    return es->start;
+}
+
+/*
+Parallel encoding of the items of a top level container. The items are collected up front, split
+into one contiguous range per thread and each range is encoded with its own JSONEncodeState
+into its own buffer. The buffers are then joined in order. */
+
+#define JSON_PARALLEL_MIN_ITEMS 64
+
+typedef struct __JSONParallelItem
+{
+    JSOBJ value;
+    const char *name;
+    size_t cbName;
+} JSONParallelItem;
+
+typedef struct __JSONParallelWorker
+{
+    const JSONObjectEncoder *enc;
+    JSONEncodeState es;
+    const JSONParallelItem *items;
+    size_t begin;
+    size_t end;
+    size_t cbOutput;
+} JSONParallelWorker;
+
+static void Parallel_EncodeRange (JSONParallelWorker *worker)
+{
+    JSONEncodeState *es = &worker->es;
+    const JSONParallelItem *item;
+    size_t index;
+
+    worker->cbOutput = 0;
+    Encoder_Reset (worker->enc, es);
+
+    /*
+    encode() starts its items at level 0 while they sit one level below the top level container,
+    take that level off the limit so the same documents are accepted as by JSON_EncodeObject */
+    es->recursionMax --;
+
+    if (!Encoder_Begin (NULL, es, NULL, 0))
+    {
+        return;
+    }
+
+    for (index = worker->begin; index < worker->end; index ++)
+    {
+        if (index > worker->begin)
+        {
+            Buffer_Reserve (es, 2);
+            if (es->errorMsg)
+            {
+                break;
+            }
+            Buffer_AppendCharUnchecked (es, ',');
 #ifndef JSON_NO_EXTRA_WHITESPACE
-                    Buffer_AppendCharUnchecked (buffer, ' ');
+            Buffer_AppendCharUnchecked (es, ' ');
 #endif
-                }
+        }
+
+        item = &worker->items[index];
+        encode (item->value, es, item->name, item->cbName);
+
+        if (es->errorMsg)
+        {
+            break;
+        }
+    }
+
+    Encoder_FreeCaches (es);
+    worker->cbOutput = es->offset - es->start;
+}
+
+#ifndef JSON_NO_THREADS
+#if defined(_WIN32)
+
+typedef HANDLE JSONThread;
+
+static DWORD WINAPI Parallel_ThreadProc (LPVOID arg)
+{
+    Parallel_EncodeRange ((JSONParallelWorker *) arg);
+    return 0;
+}
+
+static int Thread_Start (JSONThread *thread, JSONParallelWorker *worker)
+{
+    *thread = CreateThread (NULL, 0, Parallel_ThreadProc, worker, 0, NULL);
+    return *thread != NULL;
+}
+
+static void Thread_Join (JSONThread thread)
+{
+    WaitForSingleObject (thread, INFINITE);
+    CloseHandle (thread);
+}
+
+static int Thread_DefaultCount (void)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo (&info);
+    return (int) info.dwNumberOfProcessors;
+}
+
+#else
+
+typedef pthread_t JSONThread;
+
+static void *Parallel_ThreadProc (void *arg)
+{
+    Parallel_EncodeRange ((JSONParallelWorker *) arg);
+    return NULL;
+}
+
+static int Thread_Start (JSONThread *thread, JSONParallelWorker *worker)
+{
+    return pthread_create (thread, NULL, Parallel_ThreadProc, worker) == 0;
+}
+
+static void Thread_Join (JSONThread thread)
+{
+    pthread_join (thread, NULL);
+}
+
+static int Thread_DefaultCount (void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    return (int) sysconf (_SC_NPROCESSORS_ONLN);
+#else
+    return 1;
+#endif
+}
+
+#endif
+#else
+
+static int Thread_DefaultCount (void)
+{
+    return 1;
+}
+
+#endif
+
+/*
+Writes a top level value that isn't a container from the type context JSON_EncodeObjectParallelWithState
+has already begun, so beginTypeContext runs only once for it */
+static char *Parallel_EncodeScalar(JSOBJ obj, JSONEncodeState *es, JSONTypeContext *tc, char *_buffer, size_t _cbBuffer)
+{
+    JSONValue value;
 
-                iterObj = enc->iterGetValue(obj, &tc);
+    if (tc->type == JT_INVALID)
+    {
+        SetError (obj, es, "Unable to encode object");
+        return NULL;
+    }
 
-                enc->level ++;
-                encode (iterObj, enc, NULL, 0);         
-                count ++;
-            }
+    if (!Encoder_Begin(obj, es, _buffer, _cbBuffer))
+    {
+        es->encoder->endTypeContext(obj, tc);
+        return NULL;
+    }
 
-            enc->iterEnd(obj, &tc);
-            Buffer_AppendCharUnchecked (enc, ']');
-            break;
-        }
+    Encoder_ReadValue (obj, es, tc, &value);
 
-        case JT_OBJECT:
+    Buffer_Reserve(es, 256);
+    if (!es->errorMsg)
+    {
+        Buffer_AppendScalar (obj, es, tc, &value);
+    }
+
+    if (value.endContext)
+    {
+        es->encoder->endTypeContext(obj, tc);
+    }
+
+    Buffer_HashPending (es);
+
+    Buffer_Reserve(es, 1);
+    if (es->errorMsg)
+    {
+        if (es->heap)
         {
-            count = 0;
-            enc->iterBegin(obj, &tc);
+            es->free (es->start);
+        }
+        return NULL;
+    }
+    Buffer_AppendCharUnchecked(es, '\0');
 
-            Buffer_AppendCharUnchecked (enc, '{');
+    Buffer_UpdateSizeEstimate (es->offset - es->start);
+    return es->start;
+}
 
-            while (enc->iterNext(obj, &tc))
-            {
-                if (count > 0)
-                {
-                    Buffer_AppendCharUnchecked (enc, ',');
-#ifndef JSON_NO_EXTRA_WHITESPACE
-                    Buffer_AppendCharUnchecked (enc, ' ');
+char *JSON_EncodeObjectParallelWithState(JSOBJ obj, const JSONObjectEncoder *enc, JSONEncodeState *es, int threads, char *_buffer, size_t _cbBuffer)
+{
+    JSONTypeContext tc;
+    JSONParallelItem *items = NULL;
+    JSONParallelItem *newItems;
+    JSONParallelWorker *workers = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    size_t cbTotal;
+    size_t itemsPerWorker;
+    int worker;
+    char *output = NULL;
+    char *of;
+#ifndef JSON_NO_THREADS
+    JSONThread *handles = NULL;
+    int *running = NULL;
+    int started = 0;
 #endif
-                }
 
-                iterObj = enc->iterGetValue(obj, &tc);
-                objName = enc->iterGetName(obj, &tc, &szlen);
+    Encoder_Reset (enc, es);
+
+    tc.encoder = enc;
+    es->encoder->beginTypeContext(obj, &tc);
+
+    if (tc.type != JT_ARRAY && tc.type != JT_OBJECT)
+    {
+        return Parallel_EncodeScalar (obj, es, &tc, _buffer, _cbBuffer);
+    }
+
+    /*
+    Collect the items, values and names must stay valid until iterEnd */
+    es->encoder->iterBegin(obj, &tc);
 
-                enc->level ++;
-                encode (iterObj, enc, objName, szlen);          
-                count ++;
+    while (es->encoder->iterNext(obj, &tc))
+    {
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 1024;
+            newItems = (JSONParallelItem *) (items ? es->realloc (items, capacity * sizeof (JSONParallelItem)) : es->malloc (capacity * sizeof (JSONParallelItem)));
+            if (!newItems)
+            {
+                SetError (obj, es, "Could not reserve memory block");
+                goto END;
             }
+            items = newItems;
+        }
 
-            enc->iterEnd(obj, &tc);
-            Buffer_AppendCharUnchecked (enc, '}');
-            break;
+        items[count].value = es->encoder->iterGetValue(obj, &tc);
+        items[count].name = NULL;
+        items[count].cbName = 0;
+
+        if (tc.type == JT_OBJECT)
+        {
+            items[count].name = es->encoder->iterGetName(obj, &tc, &items[count].cbName);
         }
 
-        case JT_LONG:
+        count ++;
+    }
+
+    if (threads < 1)
+    {
+        threads = Thread_DefaultCount ();
+    }
+
+    if ((size_t) threads > count / JSON_PARALLEL_MIN_ITEMS)
+    {
+        threads = (int) (count / JSON_PARALLEL_MIN_ITEMS);
+    }
+
+    if (threads < 1)
+    {
+        threads = 1;
+    }
+
+    workers = (JSONParallelWorker *) es->malloc (threads * sizeof (JSONParallelWorker));
+    if (!workers)
+    {
+        SetError (obj, es, "Could not reserve memory block");
+        goto END;
+    }
+
+    itemsPerWorker = (count + threads - 1) / threads;
+
+    for (worker = 0; worker < threads; worker ++)
+    {
+        workers[worker].enc = enc;
+        workers[worker].es.hash = NULL;
+        workers[worker].items = items;
+        workers[worker].begin = worker * itemsPerWorker;
+        workers[worker].end = workers[worker].begin + itemsPerWorker;
+
+        if (workers[worker].begin > count)
         {
-            Buffer_AppendLongUnchecked (enc, enc->getLongValue(obj, &tc));
-            break;
+            workers[worker].begin = count;
         }
 
-        case JT_INT:
+        if (workers[worker].end > count)
         {
-            Buffer_AppendIntUnchecked (enc, enc->getIntValue(obj, &tc));
-            break;
+            workers[worker].end = count;
         }
+    }
 
-        case JT_TRUE:
+#ifndef JSON_NO_THREADS
+    if (threads > 1)
+    {
+        handles = (JSONThread *) es->malloc (threads * sizeof (JSONThread));
+        running = (int *) es->malloc (threads * sizeof (int));
+
+        if (handles && running)
         {
-            Buffer_AppendCharUnchecked (enc, 't');
-            Buffer_AppendCharUnchecked (enc, 'r');
-            Buffer_AppendCharUnchecked (enc, 'u');
-            Buffer_AppendCharUnchecked (enc, 'e');
-            break;
+            /*
+            The calling thread takes the first range itself */
+            for (worker = 1; worker < threads; worker ++)
+            {
+                running[worker] = Thread_Start (&handles[worker], &workers[worker]);
+            }
+            started = 1;
         }
+    }
+#endif
 
-        case JT_FALSE:
+    Parallel_EncodeRange (&workers[0]);
+
+    for (worker = 1; worker < threads; worker ++)
+    {
+#ifndef JSON_NO_THREADS
+        if (started && running[worker])
         {
-            Buffer_AppendCharUnchecked (enc, 'f');
-            Buffer_AppendCharUnchecked (enc, 'a');
-            Buffer_AppendCharUnchecked (enc, 'l');
-            Buffer_AppendCharUnchecked (enc, 's');
-            Buffer_AppendCharUnchecked (enc, 'e');
-            break;
+            Thread_Join (handles[worker]);
+            continue;
         }
+#endif
+        Parallel_EncodeRange (&workers[worker]);
+    }
 
+    /*
+    Join the ranges, or report the first error */
+    cbTotal = 3;
 
-        case JT_NULL: 
+    for (worker = 0; worker < threads; worker ++)
+    {
+        if (workers[worker].es.errorMsg && !es->errorMsg)
         {
-            Buffer_AppendCharUnchecked (enc, 'n');
-            Buffer_AppendCharUnchecked (enc, 'u');
-            Buffer_AppendCharUnchecked (enc, 'l');
-            Buffer_AppendCharUnchecked (enc, 'l');
-            break;
+            es->errorMsg = workers[worker].es.errorMsg;
+            es->errorObj = workers[worker].es.errorObj;
         }
 
-        case JT_DOUBLE:
+        cbTotal += workers[worker].cbOutput + 2;
+    }
+
+    if (!es->errorMsg)
+    {
+        if (_buffer != NULL && cbTotal <= _cbBuffer)
         {
-            if (!Buffer_AppendDoubleUnchecked (obj, enc, enc->getDoubleValue(obj, &tc)))
+            output = _buffer;
+            es->heap = 0;
+        }
+        else
+        {
+            output = (char *) es->malloc (cbTotal);
+            es->heap = 1;
+
+            if (!output)
             {
-                enc->endTypeContext(obj, &tc);
-                enc->level --;
-                return;
+                SetError (obj, es, "Could not reserve memory block");
             }
-            break;
         }
+    }
 
-        case JT_UTF8:
+    if (output)
+    {
+        of = es->hashed = output;
+        *(of++) = (tc.type == JT_ARRAY) ? '[' : '{';
+
+        for (worker = 0; worker < threads; worker ++)
         {
-            value = enc->getStringValue(obj, &tc, &szlen);
-            Buffer_Reserve(enc, ((szlen / 4) + 1) * 12);
-            if (enc->errorMsg)
+            if (workers[worker].cbOutput == 0)
             {
-                enc->endTypeContext(obj, &tc);
-                return;
+                continue;
             }
-            Buffer_AppendCharUnchecked (enc, '\"');
 
-
-            if (enc->forceASCII)
+            if (of - output > 1)
             {
-                if (!Buffer_EscapeStringValidated(obj, enc, value, value + szlen))
-                {
-                    enc->endTypeContext(obj, &tc);
-                    enc->level --;
-                    return;
-                }
+                *(of++) = ',';
+#ifndef JSON_NO_EXTRA_WHITESPACE
+                *(of++) = ' ';
+#endif
             }
-            else
+
+            memcpy (of, workers[worker].es.start, workers[worker].cbOutput);
+            of += workers[worker].cbOutput;
+
+            /*
+            The ranges were encoded concurrently, so they are hashed in order as they are joined */
+            if (es->hash)
             {
-                if (!Buffer_EscapeStringUnvalidated(enc, value, value + szlen))
-                {
-                    enc->endTypeContext(obj, &tc);
-                    enc->level --;
-                    return;
-                }
+                JSON_HashUpdate (es->hash, es->hashed, of - es->hashed);
+                es->hashed = of;
             }
+        }
 
-            Buffer_AppendCharUnchecked (enc, '\"');
-            break;
+        *(of++) = (tc.type == JT_ARRAY) ? ']' : '}';
+
+        if (es->hash)
+        {
+            JSON_HashUpdate (es->hash, es->hashed, of - es->hashed);
+        }
+
+        *(of++) = '\0';
+
+        es->start = output;
+        es->offset = of;
+        es->end = output + cbTotal;
+    }
+
+    for (worker = 0; worker < threads; worker ++)
+    {
+        if (workers[worker].es.start && workers[worker].es.heap)
+        {
+            es->free (workers[worker].es.start);
+        }
+    }
+
+END:
+#ifndef JSON_NO_THREADS
+    if (handles)
+    {
+        es->free (handles);
+    }
+
+    if (running)
+    {
+        es->free (running);
+    }
+#endif
+
+    if (workers)
+    {
+        es->free (workers);
+    }
+
+    es->encoder->iterEnd(obj, &tc);
+    es->encoder->endTypeContext(obj, &tc);
+
+    if (items)
+    {
+        es->free (items);
+    }
+
+    return es->errorMsg ? NULL : output;
+}
+
+char *JSON_EncodeObjectParallel(JSOBJ obj, JSONObjectEncoder *enc, int threads, char *_buffer, size_t _cbBuffer)
+{
+    JSONEncodeState es;
+    char *ret;
+
+    Encoder_BeginLegacy (enc, &es);
+    ret = JSON_EncodeObjectParallelWithState (obj, enc, &es, threads, _buffer, _cbBuffer);
+    Encoder_EndLegacy (enc, &es);
+    return ret;
+}
+
+/*
+Buffer pool, see JSON_PoolMalloc. Blocks from JSON_POOL_MIN_BLOCK up to JSON_POOL_MAX_BLOCK are
+rounded up to a power of two size class and kept for reuse when freed: first in a cache private
+to the freeing thread, then in JSON_POOL_SLOTS shared slots per class. A slot holds one block and
+is only ever changed by an atomic exchange or compare and swap against NULL, so taking a block
+hands it to exactly one thread and pushing and popping never see the ABA problem a linked
+freelist would have. Smaller and larger blocks go straight to malloc and free */
+
+#define JSON_POOL_MIN_SHIFT 13
+#define JSON_POOL_MIN_BLOCK (1 << JSON_POOL_MIN_SHIFT)
+#define JSON_POOL_CLASSES 10
+#define JSON_POOL_MAX_BLOCK (JSON_POOL_MIN_BLOCK << (JSON_POOL_CLASSES - 1))
+#define JSON_POOL_SLOTS 16
+
+/*
+Classes up to 256KB are cached per thread, bigger blocks only in the shared slots so idle threads
+don't each sit on megabytes */
+#define JSON_POOL_THREAD_CLASSES 6
+
+/*
+Put in front of every block, sizeClass is JSON_POOL_CLASSES for blocks which aren't pooled.
+Two size_t keep the block as aligned as malloc's */
+typedef struct __JSONPoolHeader
+{
+    size_t sizeClass;
+    size_t capacity;
+} JSONPoolHeader;
+
+static void * volatile g_poolSlots[JSON_POOL_CLASSES][JSON_POOL_SLOTS];
+
+#if defined(JSON_NO_THREADS)
+#define Pool_Load(__slot) (*(__slot))
+#define Pool_Exchange(__slot, __block) Pool_ExchangeUnlocked ((__slot), (__block))
+#define Pool_CompareExchange(__slot, __block) ((*(__slot) == NULL) ? (*(__slot) = (__block), 1) : 0)
+
+static void *Pool_ExchangeUnlocked (void * volatile *slot, void *block)
+{
+    void *previous = *slot;
+    *slot = block;
+    return previous;
+}
+#elif defined(_WIN32)
+#define Pool_Load(__slot) (*(__slot))
+#define Pool_Exchange(__slot, __block) InterlockedExchangePointer ((PVOID volatile *) (__slot), (__block))
+#define Pool_CompareExchange(__slot, __block) (InterlockedCompareExchangePointer ((PVOID volatile *) (__slot), (__block), NULL) == NULL)
+#else
+#define Pool_Load(__slot) __atomic_load_n ((__slot), __ATOMIC_RELAXED)
+#define Pool_Exchange(__slot, __block) __atomic_exchange_n ((__slot), (__block), __ATOMIC_ACQ_REL)
+#define Pool_CompareExchange(__slot, __block) __sync_bool_compare_and_swap ((__slot), NULL, (__block))
+#define JSON_POOL_THREAD_CACHE
+#endif
+
+#ifdef JSON_POOL_THREAD_CACHE
+/*
+One block per class for the current thread, handed back to the shared slots when the thread exits */
+typedef struct __JSONPoolCache
+{
+    JSONPoolHeader *blocks[JSON_POOL_THREAD_CLASSES];
+    int registered;
+} JSONPoolCache;
+
+static __thread JSONPoolCache g_poolCache;
+static pthread_key_t g_poolKey;
+static pthread_once_t g_poolKeyOnce = PTHREAD_ONCE_INIT;
+#endif
+
+static int Pool_SizeClass (size_t cbSize)
+{
+    int sizeClass = 0;
+
+    if (cbSize < JSON_POOL_MIN_BLOCK / 2 || cbSize > JSON_POOL_MAX_BLOCK)
+    {
+        return JSON_POOL_CLASSES;
+    }
+
+    while (((size_t) JSON_POOL_MIN_BLOCK << sizeClass) < cbSize)
+    {
+        sizeClass ++;
+    }
+
+    return sizeClass;
+}
+
+/*
+Threads start scanning the shared slots at different places so they don't all fight over the first */
+static size_t Pool_FirstSlot (void)
+{
+#ifdef JSON_POOL_THREAD_CACHE
+    return ((size_t) &g_poolCache >> 6) % JSON_POOL_SLOTS;
+#else
+    return 0;
+#endif
+}
+
+static JSONPoolHeader *Pool_TakeShared (size_t sizeClass)
+{
+    void * volatile *slots = g_poolSlots[sizeClass];
+    size_t first = Pool_FirstSlot ();
+    size_t index;
+    void *block;
+
+    for (index = 0; index < JSON_POOL_SLOTS; index ++)
+    {
+        void * volatile *slot = &slots[(first + index) % JSON_POOL_SLOTS];
+
+        if (Pool_Load (slot) != NULL && (block = Pool_Exchange (slot, NULL)) != NULL)
+        {
+            return (JSONPoolHeader *) block;
         }
     }
 
-    enc->endTypeContext(obj, &tc);
-    enc->level --;
+    return NULL;
+}
+
+static void Pool_PutShared (JSONPoolHeader *header)
+{
+    void * volatile *slots = g_poolSlots[header->sizeClass];
+    size_t first = Pool_FirstSlot ();
+    size_t index;
+
+    for (index = 0; index < JSON_POOL_SLOTS; index ++)
+    {
+        void * volatile *slot = &slots[(first + index) % JSON_POOL_SLOTS];
+
+        if (Pool_Load (slot) == NULL && Pool_CompareExchange (slot, header))
+        {
+            return;
+        }
+    }
 
+    free (header);
 }
 
-char *JSON_EncodeObject(JSOBJ obj, JSONObjectEncoder *enc, char *_buffer, size_t _cbBuffer)
+#ifdef JSON_POOL_THREAD_CACHE
+static void Pool_ThreadExit (void *arg)
 {
-    enc->malloc = enc->malloc ? enc->malloc : malloc;
-    enc->free =  enc->free ? enc->free : free;
-    enc->realloc = enc->realloc ? enc->realloc : realloc;
-    enc->errorMsg = NULL;
-    enc->errorObj = NULL;
-    enc->level = 0;
+    JSONPoolCache *cache = (JSONPoolCache *) arg;
+    int sizeClass;
 
-    if (enc->recursionMax < 1)
+    for (sizeClass = 0; sizeClass < JSON_POOL_THREAD_CLASSES; sizeClass ++)
     {
-        enc->recursionMax = JSON_MAX_RECURSION_DEPTH;
+        if (cache->blocks[sizeClass])
+        {
+            Pool_PutShared (cache->blocks[sizeClass]);
+            cache->blocks[sizeClass] = NULL;
+        }
     }
+}
+
+static void Pool_CreateKey (void)
+{
+    pthread_key_create (&g_poolKey, Pool_ThreadExit);
+}
+#endif
+
+static void Pool_Release (JSONPoolHeader *header)
+{
+#ifdef JSON_POOL_THREAD_CACHE
+    JSONPoolCache *cache = &g_poolCache;
+#endif
 
-    if (enc->doublePrecision < 0 ||
-            enc->doublePrecision > JSON_DOUBLE_MAX_DECIMALS)
+    if (header->sizeClass == JSON_POOL_CLASSES)
     {
-        enc->doublePrecision = JSON_DOUBLE_MAX_DECIMALS;
+        free (header);
+        return;
     }
 
-    if (_buffer == NULL)
+#ifdef JSON_POOL_THREAD_CACHE
+    if (header->sizeClass < JSON_POOL_THREAD_CLASSES && !cache->blocks[header->sizeClass])
     {
-        _cbBuffer = 32768;
-        enc->start = (char *) enc->malloc (_cbBuffer);
-        if (!enc->start)
+        if (!cache->registered)
+        {
+            pthread_once (&g_poolKeyOnce, Pool_CreateKey);
+            pthread_setspecific (g_poolKey, cache);
+            cache->registered = 1;
+        }
+
+        cache->blocks[header->sizeClass] = header;
+        return;
+    }
+#endif
+
+    Pool_PutShared (header);
+}
+
+void *JSON_PoolMalloc(size_t size)
+{
+    size_t sizeClass = Pool_SizeClass (size);
+    size_t capacity = size;
+    JSONPoolHeader *header = NULL;
+
+    if (sizeClass < JSON_POOL_CLASSES)
+    {
+#ifdef JSON_POOL_THREAD_CACHE
+        if (sizeClass < JSON_POOL_THREAD_CLASSES && g_poolCache.blocks[sizeClass])
+        {
+            header = g_poolCache.blocks[sizeClass];
+            g_poolCache.blocks[sizeClass] = NULL;
+        }
+        else
+#endif
+        {
+            header = Pool_TakeShared (sizeClass);
+        }
+
+        capacity = (size_t) JSON_POOL_MIN_BLOCK << sizeClass;
+    }
+
+    if (!header)
+    {
+        header = (JSONPoolHeader *) malloc (sizeof (JSONPoolHeader) + capacity);
+        if (!header)
         {
-            SetError(obj, enc, "Could not reserve memory block");
             return NULL;
         }
-        enc->heap = 1;
+        header->sizeClass = sizeClass;
+        header->capacity = capacity;
     }
-    else
+
+    return header + 1;
+}
+
+void *JSON_PoolRealloc(void *base, size_t size)
+{
+    JSONPoolHeader *header;
+    size_t sizeClass;
+    size_t capacity;
+
+    if (!base)
     {
-        enc->start = _buffer;
-        enc->heap = 0;
+        return JSON_PoolMalloc (size);
     }
 
-    enc->end = enc->start + _cbBuffer;
-    enc->offset = enc->start;
+    header = ((JSONPoolHeader *) base) - 1;
+
+    /*
+    Growing within the block's size class is free */
+    if (size <= header->capacity)
+    {
+        return base;
+    }
 
+    /*
+    Grow with realloc rather than by copying into a pooled block, realloc can often extend a block in
+    place or remap its pages. The block then joins the class of its new size once it's freed */
+    sizeClass = Pool_SizeClass (size);
+    capacity = sizeClass < JSON_POOL_CLASSES ? (size_t) JSON_POOL_MIN_BLOCK << sizeClass : size;
 
-    encode (obj, enc, NULL, 0);
-    
-    Buffer_Reserve(enc, 1);
-    if (enc->errorMsg)
+    header = (JSONPoolHeader *) realloc (header, sizeof (JSONPoolHeader) + capacity);
+    if (!header)
     {
         return NULL;
     }
-    Buffer_AppendCharUnchecked(enc, '\0');
 
-    return enc->start;
+    header->sizeClass = sizeClass;
+    header->capacity = capacity;
+    return header + 1;
+}
+
+void JSON_PoolFree(void *base)
+{
+    if (base)
+    {
+        Pool_Release (((JSONPoolHeader *) base) - 1);
+    }
+}
+
+void JSON_PoolTrim(void)
+{
+    size_t sizeClass;
+    size_t index;
+    void *block;
+
+#ifdef JSON_POOL_THREAD_CACHE
+    Pool_ThreadExit (&g_poolCache);
+#endif
+
+    for (sizeClass = 0; sizeClass < JSON_POOL_CLASSES; sizeClass ++)
+    {
+        for (index = 0; index < JSON_POOL_SLOTS; index ++)
+        {
+            block = Pool_Exchange (&g_poolSlots[sizeClass][index], NULL);
+            if (block)
+            {
+                free (block);
+            }
+        }
+    }
 }
@@ -37,8 +37,13 @@ http://www.opensource.apple.com/source/tcl/tcl-14/tcl/license.terms
 
 #include "py_defines.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <datetime.h>
 #include <ultrajson.h>
+#ifdef JSON_WITH_ZLIB
+#include <zlib.h>
+#endif
 
 #define EPOCH_ORD 719163
 
@@ -68,6 +73,11 @@ typedef struct __TypeContext
     PyObject *iterator;
 
     JSINT64 longValue;
+    int scale;
+
+    void *bulkValues;
+
+    struct __SortedItem *sortedItems;
 
 } TypeContext;
 
@@ -84,8 +94,27 @@ struct PyDictIterState
 //#define PRINTMARK() fprintf(stderr, "%s: MARK(%d)\n", __FILE__, __LINE__)     
 #define PRINTMARK()         
 
+static PyObject *type_decimal = NULL;
+static PyObject *decimal_str = NULL;
+
 void initObjToJSON(void)
 {
+    PyObject *mod_decimal = PyImport_ImportModule("decimal");
+
+    if (mod_decimal)
+    {
+        type_decimal = PyObject_GetAttrString(mod_decimal, "Decimal");
+        Py_DECREF(mod_decimal);
+    }
+
+    /*
+    tp_str of a Decimal written in Python looks __str__ up on the subclass, see Decimal_Str */
+    if (type_decimal && PyType_HasFeature((PyTypeObject *) type_decimal, Py_TPFLAGS_HEAPTYPE))
+    {
+        decimal_str = PyObject_GetAttrString(type_decimal, "__str__");
+    }
+    PyErr_Clear();
+
     PyDateTime_IMPORT;
 }
 
@@ -116,6 +145,12 @@ static void *PyFloatToDOUBLE(JSOBJ _obj, JSONTypeContext *tc, void *outValue, si
     return NULL;
 }
 
+static void *PyDecimalToDOUBLE(JSOBJ _obj, JSONTypeContext *tc, void *outValue, size_t *_outLen)
+{
+    *((double *) outValue) = PyFloat_AS_DOUBLE (GET_TC(tc)->newObj);
+    return NULL;
+}
+
 static void *PyStringToUTF8(JSOBJ _obj, JSONTypeContext *tc, void *outValue, size_t *_outLen)
 {
     PyObject *obj = (PyObject *) _obj;
@@ -123,17 +158,337 @@ static void *PyStringToUTF8(JSOBJ _obj, JSONTypeContext *tc, void *outValue, siz
     return PyString_AS_STRING(obj);
 }
 
+/*
+Reads the temporary UTF-8 copy made by Object_beginTypeContext */
 static void *PyUnicodeToUTF8(JSOBJ _obj, JSONTypeContext *tc, void *outValue, size_t *_outLen)
 {
-    PyObject *obj = (PyObject *) _obj;
-    PyObject *newObj = PyUnicode_EncodeUTF8 (PyUnicode_AS_UNICODE(obj), PyUnicode_GET_SIZE(obj), NULL);
+    PyObject *newObj = GET_TC(tc)->newObj;
 
-    GET_TC(tc)->newObj = newObj;
+    *_outLen = PyString_GET_SIZE(newObj);
+    return PyString_AS_STRING(newObj);
+}
 
+static void *PyRawJSONToUTF8(JSOBJ _obj, JSONTypeContext *tc, void *outValue, size_t *_outLen)
+{
+    PyObject *newObj = GET_TC(tc)->newObj;
     *_outLen = PyString_GET_SIZE(newObj);
     return PyString_AS_STRING(newObj);
 }
 
+/*
+Reads a finite decimal.Decimal as mantissa * 10^-scale. Returns 1 if the digits fit a JSINT64 and the scale is
+within JSON_DECIMAL_MAX_SCALE, 0 if they don't, obj is a negative zero which a JSINT64 can't carry, or obj is
+NaN or Infinity and -1 on error */
+/*
+Formats a decimal the way Decimal itself does, a subclass overriding __str__ must not change the number written */
+static PyObject *Decimal_Str(PyObject *obj)
+{
+    if (decimal_str)
+    {
+        return PyObject_CallFunctionObjArgs(decimal_str, obj, NULL);
+    }
+
+    return ((PyTypeObject *) type_decimal)->tp_str(obj);
+}
+
+/*
+Canonical form of a finite decimal as formatted by Decimal_Str, for the decimals the fast path can't take.
+Matches Buffer_AppendDecimal in canonical mode: trailing zeros dropped, any zero written as 0, written out
+in full while the exponent stays within JSON_DECIMAL_MAX_SCALE and as d.ddde+N beyond */
+static PyObject *Decimal_Canonical(const char *str, Py_ssize_t cbString)
+{
+    const char *end = str + cbString;
+    char *digits, *output, *of;
+    PyObject *result;
+    Py_ssize_t count = 0, first = 0, index;
+    JSINT64 exp = 0, written = 0;
+    JSUINT64 uexp;
+    char expDigits[24];
+    int negative, expNegative, fraction = 0, cbExp = 0;
+
+    digits = (char *) PyObject_Malloc(cbString + 1);
+    output = (char *) PyObject_Malloc(cbString + JSON_DECIMAL_MAX_SCALE + 32);
+    if (!digits || !output)
+    {
+        PyObject_Free(digits);
+        PyObject_Free(output);
+        return PyErr_NoMemory();
+    }
+
+    negative = (str < end && *str == '-');
+    str += negative;
+
+    for (; str < end && *str != 'E'; str ++)
+    {
+        if (*str == '.')
+        {
+            fraction = 1;
+            continue;
+        }
+        digits[count++] = *str;
+        exp -= fraction;
+    }
+
+    if (str < end)
+    {
+        expNegative = (str[1] == '-');
+
+        for (str += 2; str < end && written < 1000000000000000000LL; str ++)
+        {
+            written = written * 10 + (*str - '0');
+        }
+        exp += expNegative ? -written : written;
+    }
+
+    while (first < count && digits[first] == '0')
+    {
+        first ++;
+    }
+
+    while (count > first && digits[count - 1] == '0')
+    {
+        count --;
+        exp ++;
+    }
+
+    of = output;
+
+    if (first == count)
+    {
+        *(of++) = '0';
+    }
+    else
+    {
+        if (negative)
+        {
+            *(of++) = '-';
+        }
+
+        if (exp > JSON_DECIMAL_MAX_SCALE || exp < -JSON_DECIMAL_MAX_SCALE)
+        {
+            *(of++) = digits[first];
+            if (count - first > 1)
+            {
+                *(of++) = '.';
+                memcpy (of, digits + first + 1, count - first - 1);
+                of += count - first - 1;
+            }
+
+            exp += count - first - 1;
+            *(of++) = 'e';
+            *(of++) = exp < 0 ? '-' : '+';
+
+            uexp = (JSUINT64) (exp < 0 ? -exp : exp);
+            do
+            {
+                expDigits[cbExp++] = (char) ('0' + uexp % 10);
+            } while (uexp /= 10);
+
+            while (cbExp > 0)
+            {
+                *(of++) = expDigits[--cbExp];
+            }
+        }
+        else
+        if (exp >= 0)
+        {
+            memcpy (of, digits + first, count - first);
+            of += count - first;
+            memset (of, '0', (size_t) exp);
+            of += exp;
+        }
+        else
+        if (count - first > -exp)
+        {
+            index = count + (Py_ssize_t) exp;
+            memcpy (of, digits + first, index - first);
+            of += index - first;
+            *(of++) = '.';
+            memcpy (of, digits + index, count - index);
+            of += count - index;
+        }
+        else
+        {
+            *(of++) = '0';
+            *(of++) = '.';
+            memset (of, '0', (size_t) (-exp - (count - first)));
+            of += -exp - (count - first);
+            memcpy (of, digits + first, count - first);
+            of += count - first;
+        }
+    }
+
+    result = PyBytes_FromStringAndSize(output, of - output);
+    PyObject_Free(digits);
+    PyObject_Free(output);
+    return result;
+}
+
+static int Decimal_ToFixed(PyObject *obj, JSINT64 *mantissa, int *scale)
+{
+    JSUINT64 value = 0;
+    long exp = 0;
+    int result = -1;
+#if PY_MAJOR_VERSION >= 3
+    PyObject *str;
+    const char *digit, *end;
+    Py_ssize_t cbString;
+    int negative, count = 0, fraction = 0, expNegative;
+
+    /*
+    The C decimal has nothing to read its digits from, as_tuple builds a named tuple of digit objects and
+    is slower than formatting. So parse the string it formats itself to in C, which always has the form
+    [-]digits[.digits][E(+|-)digits] for finite values, NaN and Infinity fail on the first character */
+    str = Decimal_Str(obj);
+    if (!str)
+    {
+        return -1;
+    }
+
+    digit = PyUnicode_AsUTF8AndSize(str, &cbString);
+    if (!digit)
+    {
+        goto DONE;
+    }
+    end = digit + cbString;
+
+    result = 0;
+
+    negative = (digit < end && *digit == '-');
+    digit += negative;
+
+    for (; digit < end; digit ++)
+    {
+        if (*digit >= '0' && *digit <= '9')
+        {
+            if (++count > 18)
+            {
+                goto DONE;
+            }
+            value = value * 10 + (JSUINT64) (*digit - '0');
+            exp -= fraction;
+        }
+        else
+        if (*digit == '.' && !fraction)
+        {
+            fraction = 1;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (count == 0)
+    {
+        goto DONE;
+    }
+
+    if (digit < end)
+    {
+        long written = 0;
+
+        if (*(digit++) != 'E' || digit == end || (*digit != '+' && *digit != '-'))
+        {
+            goto DONE;
+        }
+        expNegative = (*(digit++) == '-');
+
+        for (; digit < end && *digit >= '0' && *digit <= '9'; digit ++)
+        {
+            if (written > JSON_DECIMAL_MAX_SCALE * 2)
+            {
+                goto DONE;
+            }
+            written = written * 10 + (*digit - '0');
+        }
+
+        if (digit != end)
+        {
+            goto DONE;
+        }
+        exp += expNegative ? -written : written;
+    }
+#else
+    PyObject *sign = NULL, *digits = NULL, *exponent = NULL;
+    PyObject *special;
+    const char *digitString;
+    Py_ssize_t index, count;
+    int negative, isSpecial;
+
+    /*
+    The pure Python decimal keeps its digits as a string in _int, the exponent in _exp and the sign in _sign */
+    special = PyObject_GetAttrString(obj, "_is_special");
+    if (!special)
+    {
+        return -1;
+    }
+
+    isSpecial = PyObject_IsTrue(special);
+    Py_DECREF(special);
+    if (isSpecial)
+    {
+        return isSpecial < 0 ? -1 : 0;
+    }
+
+    digits = PyObject_GetAttrString(obj, "_int");
+    exponent = PyObject_GetAttrString(obj, "_exp");
+    sign = PyObject_GetAttrString(obj, "_sign");
+
+    if (!digits || !exponent || !sign)
+    {
+        goto DONE;
+    }
+
+    result = 0;
+
+    if (!PyString_Check(digits))
+    {
+        goto DONE;
+    }
+
+    count = PyString_GET_SIZE(digits);
+    if (count > 18)
+    {
+        goto DONE;
+    }
+
+    digitString = PyString_AS_STRING(digits);
+    for (index = 0; index < count; index ++)
+    {
+        value = value * 10 + (JSUINT64) (digitString[index] - '0');
+    }
+
+    exp = PyLong_AsLong(exponent);
+    if (exp == -1 && PyErr_Occurred())
+    {
+        PyErr_Clear();
+        goto DONE;
+    }
+
+    negative = PyObject_IsTrue(sign);
+#endif
+
+    if (exp > JSON_DECIMAL_MAX_SCALE || exp < -JSON_DECIMAL_MAX_SCALE || (negative && value == 0))
+    {
+        goto DONE;
+    }
+
+    *mantissa = negative ? -(JSINT64) value : (JSINT64) value;
+    *scale = (int) -exp;
+    result = 1;
+
+DONE:
+#if PY_MAJOR_VERSION >= 3
+    Py_DECREF(str);
+#else
+    Py_XDECREF(digits);
+    Py_XDECREF(exponent);
+    Py_XDECREF(sign);
+#endif
+    return result;
+}
+
 static void *PyDateTimeToINT64(JSOBJ _obj, JSONTypeContext *tc, void *outValue, size_t *_outLen)
 {
     PyObject *obj = (PyObject *) _obj;
@@ -511,9 +866,153 @@ char *Dict_iterGetName(JSOBJ obj, JSONTypeContext *tc, size_t *outLen)
 }
 
 
+//=============================================================================
+// Sorted dict iteration functions, used when sortKeys is set
+// All names are converted to UTF-8 up front and sorted byte-wise.
+// sortedItems holds a reference to every name, values are borrowed from the dict
+// as in Dict iteration, an extra reference would make every value look shared to memoize
+//=============================================================================
+typedef struct __SortedItem
+{
+    PyObject *name;
+    PyObject *value;
+} SortedItem;
+
+static int SortedItem_Compare(const void *a, const void *b)
+{
+    PyObject *nameA = ((const SortedItem *) a)->name;
+    PyObject *nameB = ((const SortedItem *) b)->name;
+    Py_ssize_t cbA = PyString_GET_SIZE(nameA);
+    Py_ssize_t cbB = PyString_GET_SIZE(nameB);
+    int result = memcmp (PyString_AS_STRING(nameA), PyString_AS_STRING(nameB), cbA < cbB ? cbA : cbB);
+
+    if (result != 0)
+    {
+        return result;
+    }
+
+    return (cbA > cbB) - (cbA < cbB);
+}
+
+void SortedDict_iterBegin(JSOBJ obj, JSONTypeContext *tc)
+{
+    PyObject *dictObj = GET_TC(tc)->dictObj;
+    PyObject *key;
+    PyObject *value;
+    PyObject *name;
+    Py_ssize_t pos = 0;
+    Py_ssize_t count = 0;
+    Py_ssize_t index;
+    SortedItem *items;
+#if PY_MAJOR_VERSION >= 3
+    PyObject* nameTmp;
+#endif
+
+    GET_TC(tc)->index = 0;
+    GET_TC(tc)->size = 0;
+
+    items = (SortedItem *) PyObject_Malloc((PyDict_Size(dictObj) + 1) * sizeof(SortedItem));
+    if (!items)
+    {
+        PyErr_NoMemory();
+        return;
+    }
+    GET_TC(tc)->sortedItems = items;
+
+    while (PyDict_Next (dictObj, &pos, &key, &value))
+    {
+        if (PyUnicode_Check(key))
+        {
+            name = PyUnicode_AsUTF8String (key);
+        }
+        else
+        if (!PyString_Check(key))
+        {
+            name = PyObject_Str(key);
+#if PY_MAJOR_VERSION >= 3
+            nameTmp = name;
+            name = nameTmp ? PyUnicode_AsUTF8String (nameTmp) : NULL;
+            Py_XDECREF(nameTmp);
+#endif
+        }
+        else
+        {
+            name = key;
+            Py_INCREF(name);
+        }
+
+        if (!name)
+        {
+            break;
+        }
+
+        items[count].name = name;
+        items[count].value = value;
+        count ++;
+    }
+
+    GET_TC(tc)->size = count;
+    qsort (items, count, sizeof(SortedItem), SortedItem_Compare);
+
+    /*
+    Keys such as 1 and '1' give the same name, their order would then depend on the dict */
+    if (tc->encoder->canonical)
+    {
+        for (index = 1; index < count; index ++)
+        {
+            if (SortedItem_Compare (&items[index - 1], &items[index]) == 0)
+            {
+                PyErr_Format (PyExc_ValueError, "Key '%s' occurs more than once in canonical output", PyString_AS_STRING(items[index].name));
+                break;
+            }
+        }
+    }
+    PRINTMARK();
+}
+
+int SortedDict_iterNext(JSOBJ obj, JSONTypeContext *tc)
+{
+    SortedItem *item;
+
+    if (GET_TC(tc)->index >= GET_TC(tc)->size || PyErr_Occurred())
+    {
+        PRINTMARK();
+        return 0;
+    }
+
+    item = GET_TC(tc)->sortedItems + GET_TC(tc)->index;
+    GET_TC(tc)->itemName = item->name;
+    GET_TC(tc)->itemValue = item->value;
+    GET_TC(tc)->index ++;
+    PRINTMARK();
+    return 1;
+}
+
+void SortedDict_iterEnd(JSOBJ obj, JSONTypeContext *tc)
+{
+    SortedItem *items = GET_TC(tc)->sortedItems;
+    Py_ssize_t index;
+
+    if (items)
+    {
+        for (index = 0; index < GET_TC(tc)->size; index ++)
+        {
+            Py_DECREF(items[index].name);
+        }
+        PyObject_Free(items);
+        GET_TC(tc)->sortedItems = NULL;
+    }
+
+    GET_TC(tc)->itemName = NULL;
+    GET_TC(tc)->itemValue = NULL;
+    Py_DECREF(GET_TC(tc)->dictObj);
+    PRINTMARK();
+}
+
+
 void Object_beginTypeContext (JSOBJ _obj, JSONTypeContext *tc)
 {
-    PyObject *obj, *exc, *toDictFunc;
+    PyObject *obj, *exc, *toDictFunc, *toJSONFunc, *isFinite, *utf8;
     TypeContext *pc;
     PRINTMARK();
     if (!_obj) {
@@ -539,6 +1038,8 @@ void Object_beginTypeContext (JSOBJ _obj, JSONTypeContext *tc)
     pc->index = 0;
     pc->size = 0;
     pc->longValue = 0;
+    pc->bulkValues = NULL;
+    pc->sortedItems = NULL;
     
     if (PyIter_Check(obj))
     {
@@ -592,6 +1093,13 @@ void Object_beginTypeContext (JSOBJ _obj, JSONTypeContext *tc)
     if (PyUnicode_Check(obj))
     {
         PRINTMARK();
+        /*
+        Converted up front so strings which can't be encoded (lone surrogates) fail the encode */
+        pc->newObj = PyUnicode_AsUTF8String(obj);
+        if (!pc->newObj)
+        {
+            goto INVALID;
+        }
         pc->PyTypeToJSON = PyUnicodeToUTF8; tc->type = JT_UTF8;
         return;
     }
@@ -602,6 +1110,70 @@ void Object_beginTypeContext (JSOBJ _obj, JSONTypeContext *tc)
         pc->PyTypeToJSON = PyFloatToDOUBLE; tc->type = JT_DOUBLE;
         return;
     }
+    else
+    if (type_decimal && PyObject_TypeCheck(obj, (PyTypeObject *) type_decimal))
+    {
+        PRINTMARK();
+        switch (Decimal_ToFixed(obj, &pc->longValue, &pc->scale))
+        {
+            case 1:
+                tc->type = JT_DECIMAL;
+                return;
+
+            case 0:
+                break;
+
+            default:
+                goto INVALID;
+        }
+
+        /*
+        NaN and Infinity are refused like the equal floats, finite decimals too large for a JSINT64
+        are written as str gives them, which is always a valid JSON number */
+        isFinite = PyObject_CallMethod(type_decimal, "is_finite", "O", obj);
+        if (!isFinite)
+        {
+            goto INVALID;
+        }
+
+        if (!PyObject_IsTrue(isFinite))
+        {
+            Py_DECREF(isFinite);
+            pc->newObj = PyNumber_Float(obj);
+            if (!pc->newObj)
+            {
+                goto INVALID;
+            }
+            pc->PyTypeToJSON = PyDecimalToDOUBLE; tc->type = JT_DOUBLE;
+            return;
+        }
+        Py_DECREF(isFinite);
+
+        pc->newObj = Decimal_Str(obj);
+        if (pc->newObj && PyUnicode_Check(pc->newObj))
+        {
+            utf8 = PyUnicode_AsUTF8String(pc->newObj);
+            Py_DECREF(pc->newObj);
+            pc->newObj = utf8;
+        }
+
+        /*
+        Canonical output normalizes these as Buffer_AppendDecimal does the others, a negative zero
+        becomes 0 like it does for floats */
+        if (pc->newObj && tc->encoder->canonical)
+        {
+            utf8 = Decimal_Canonical(PyString_AS_STRING(pc->newObj), PyString_GET_SIZE(pc->newObj));
+            Py_DECREF(pc->newObj);
+            pc->newObj = utf8;
+        }
+
+        if (!pc->newObj)
+        {
+            goto INVALID;
+        }
+        pc->PyTypeToJSON = PyRawJSONToUTF8; tc->type = JT_RAW;
+        return;
+    }
     else 
     if (PyDateTime_Check(obj))
     {
@@ -630,9 +1202,18 @@ ISITERABLE:
     {
         PRINTMARK();
         tc->type = JT_OBJECT;
-        pc->iterBegin = Dict_iterBegin;
-        pc->iterEnd = Dict_iterEnd;
-        pc->iterNext = Dict_iterNext;
+        if (tc->encoder->sortKeys)
+        {
+            pc->iterBegin = SortedDict_iterBegin;
+            pc->iterEnd = SortedDict_iterEnd;
+            pc->iterNext = SortedDict_iterNext;
+        }
+        else
+        {
+            pc->iterBegin = Dict_iterBegin;
+            pc->iterEnd = Dict_iterEnd;
+            pc->iterNext = Dict_iterNext;
+        }
         pc->iterGetValue = Dict_iterGetValue;
         pc->iterGetName = Dict_iterGetName;
         pc->dictObj = obj;
@@ -679,20 +1260,61 @@ ISITERABLE:
     }
 
 
-    toDictFunc = PyObject_GetAttrString(obj, "toDict");
+    toJSONFunc = PyObject_GetAttrString(obj, "__json__");
 
-    if (toDictFunc)
+    if (toJSONFunc)
     {
         PyObject* tuple = PyTuple_New(0);
-        PyObject* toDictResult = PyObject_Call(toDictFunc, tuple, NULL);
+        PyObject* toJSONResult = PyObject_Call(toJSONFunc, tuple, NULL);
         Py_DECREF(tuple);
-        Py_DECREF(toDictFunc);
+        Py_DECREF(toJSONFunc);
 
-        if (toDictResult == NULL)
+        if (toJSONResult == NULL)
         {
-            PyErr_Clear();
-            tc->type = JT_NULL;
-            return;
+            goto INVALID;
+        }
+
+        if (PyUnicode_Check(toJSONResult))
+        {
+            PyObject *utf8 = PyUnicode_AsUTF8String(toJSONResult);
+            Py_DECREF(toJSONResult);
+            toJSONResult = utf8;
+
+            if (toJSONResult == NULL)
+            {
+                goto INVALID;
+            }
+        }
+
+        if (!PyString_Check(toJSONResult))
+        {
+            Py_DECREF(toJSONResult);
+            PyErr_Format (PyExc_TypeError, "__json__ must return a string");
+            goto INVALID;
+        }
+
+        PRINTMARK();
+        pc->newObj = toJSONResult;
+        pc->PyTypeToJSON = PyRawJSONToUTF8; tc->type = JT_RAW;
+        return;
+    }
+
+    PyErr_Clear();
+
+    toDictFunc = PyObject_GetAttrString(obj, "toDict");
+
+    if (toDictFunc)
+    {
+        PyObject* tuple = PyTuple_New(0);
+        PyObject* toDictResult = PyObject_Call(toDictFunc, tuple, NULL);
+        Py_DECREF(tuple);
+        Py_DECREF(toDictFunc);
+
+        if (toDictResult == NULL)
+        {
+            PyErr_Clear();
+            tc->type = JT_NULL;
+            return;
         }
 
         if (!PyDict_Check(toDictResult))
@@ -704,9 +1326,18 @@ ISITERABLE:
 
         PRINTMARK();
         tc->type = JT_OBJECT;
-        pc->iterBegin = Dict_iterBegin;
-        pc->iterEnd = Dict_iterEnd;
-        pc->iterNext = Dict_iterNext;
+        if (tc->encoder->sortKeys)
+        {
+            pc->iterBegin = SortedDict_iterBegin;
+            pc->iterEnd = SortedDict_iterEnd;
+            pc->iterNext = SortedDict_iterNext;
+        }
+        else
+        {
+            pc->iterBegin = Dict_iterBegin;
+            pc->iterEnd = Dict_iterEnd;
+            pc->iterNext = Dict_iterNext;
+        }
         pc->iterGetValue = Dict_iterGetValue;
         pc->iterGetName = Dict_iterGetName;
         pc->dictObj = toDictResult;
@@ -769,11 +1400,178 @@ double Object_getDoubleValue(JSOBJ obj, JSONTypeContext *tc)
     return ret;
 }
 
+JSINT64 Object_getDecimalValue(JSOBJ obj, JSONTypeContext *tc, int *outScale)
+{
+    *outScale = GET_TC(tc)->scale;
+    return GET_TC(tc)->longValue;
+}
+
+/*
+Fused getValue callback. The common exact scalar types are answered straight away without setting
+up a TypeContext, everything else goes through Object_beginTypeContext */
+static void Object_getValue(JSOBJ _obj, JSONTypeContext *tc, JSONValue *value)
+{
+    PyObject *obj = (PyObject *) _obj;
+
+    tc->prv = NULL;
+
+    if (obj == Py_None)
+    {
+        tc->type = JT_NULL;
+        return;
+    }
+    else
+    if (obj == Py_True)
+    {
+        tc->type = JT_TRUE;
+        return;
+    }
+    else
+    if (obj == Py_False)
+    {
+        tc->type = JT_FALSE;
+        return;
+    }
+    else
+    if (PyFloat_CheckExact(obj))
+    {
+        tc->type = JT_DOUBLE;
+        value->doubleValue = PyFloat_AS_DOUBLE(obj);
+        return;
+    }
+#if PY_MAJOR_VERSION < 3
+    else
+    if (PyInt_CheckExact(obj))
+    {
+        tc->type = JT_LONG;
+        value->longValue = PyInt_AS_LONG(obj);
+        return;
+    }
+    else
+    if (PyString_CheckExact(obj))
+    {
+        tc->type = JT_UTF8;
+        value->stringValue = PyString_AS_STRING(obj);
+        value->cbString = PyString_GET_SIZE(obj);
+        return;
+    }
+#else
+    else
+    if (PyUnicode_CheckExact(obj) && PyUnicode_IS_COMPACT_ASCII(obj))
+    {
+        /*
+        An ASCII str is its own UTF-8 form. Other strings go through a temporary UTF-8 copy, asking them
+        for their UTF-8 form would have it cached on the caller's strings for as long as they live */
+        tc->type = JT_UTF8;
+        value->stringValue = (const char *) PyUnicode_DATA(obj);
+        value->cbString = PyUnicode_GET_LENGTH(obj);
+        return;
+    }
+#endif
+    else
+    if (PyLong_CheckExact(obj))
+    {
+        value->longValue = PyLong_AsLongLong(obj);
+        if (!(value->longValue == -1 && PyErr_Occurred()))
+        {
+            tc->type = JT_LONG;
+            return;
+        }
+        PyErr_Clear();
+    }
+    else
+    if (Py_TYPE(obj) == (PyTypeObject *) type_decimal)
+    {
+        if (Decimal_ToFixed(obj, &value->longValue, &value->scale) > 0)
+        {
+            tc->type = JT_DECIMAL;
+            return;
+        }
+        PyErr_Clear();
+    }
+
+    Object_beginTypeContext(obj, tc);
+
+    switch (tc->type)
+    {
+        case JT_INVALID:
+        case JT_ARRAY:
+        case JT_OBJECT:
+            return;
+
+        case JT_LONG:
+            value->longValue = Object_getLongValue(obj, tc);
+            break;
+
+        case JT_INT:
+            value->longValue = Object_getIntValue(obj, tc);
+            break;
+
+        case JT_DOUBLE:
+            value->doubleValue = Object_getDoubleValue(obj, tc);
+            break;
+
+        case JT_DECIMAL:
+            value->longValue = Object_getDecimalValue(obj, tc, &value->scale);
+            break;
+
+        case JT_UTF8:
+        case JT_RAW:
+            value->stringValue = Object_getStringValue(obj, tc, &value->cbString);
+            break;
+    }
+
+    value->endContext = 1;
+}
+
+/*
+Only plain dicts, lists and tuples referenced from more than one place can show up repeatedly in a
+document so only those are worth memoizing. The dict iterator holds a reference of its own */
+static int Object_memoize(JSOBJ _obj, JSONTypeContext *tc)
+{
+    PyObject *obj = (PyObject *) _obj;
+    Py_ssize_t refs = Py_REFCNT(obj);
+
+    if (PyDict_CheckExact(obj))
+    {
+        refs --;
+    }
+    else
+    if (!PyList_CheckExact(obj) && !PyTuple_CheckExact(obj))
+    {
+        return 0;
+    }
+
+    if (refs < 2)
+    {
+        return 0;
+    }
+
+    Py_INCREF(obj);
+    return 1;
+}
+
 static void Object_releaseObject(JSOBJ _obj)
 {
     Py_DECREF( (PyObject *) _obj);
 }
 
+/*
+str objects own the bytes handed out by PyStringToUTF8, keep a reference so JSON_EncodeObjectToIOVec
+can point at them. Unicode is converted to a temporary and can't be held */
+static int Object_holdString(JSOBJ _obj, JSONTypeContext *tc)
+{
+    PyObject *obj = (PyObject *) _obj;
+
+    if (!PyString_Check(obj))
+    {
+        return 0;
+    }
+
+    Py_INCREF(obj);
+    return 1;
+}
+
 
 
 void Object_iterBegin(JSOBJ obj, JSONTypeContext *tc)
@@ -789,6 +1587,12 @@ int Object_iterNext(JSOBJ obj, JSONTypeContext *tc)
 void Object_iterEnd(JSOBJ obj, JSONTypeContext *tc)
 {
     GET_TC(tc)->iterEnd(obj, tc);
+
+    if (GET_TC(tc)->bulkValues)
+    {
+        PyObject_Free(GET_TC(tc)->bulkValues);
+        GET_TC(tc)->bulkValues = NULL;
+    }
 }
 
 JSOBJ Object_iterGetValue(JSOBJ obj, JSONTypeContext *tc)
@@ -801,150 +1605,1057 @@ char *Object_iterGetName(JSOBJ obj, JSONTypeContext *tc, size_t *outLen)
     return GET_TC(tc)->iterGetName(obj, tc, outLen);
 }
 
-
-PyObject* objToJSON(PyObject* self, PyObject *args, PyObject *kwargs)
+size_t Object_iterSizeHint(JSOBJ _obj, JSONTypeContext *tc)
 {
-    static char *kwlist[] = { "obj", "ensure_ascii", "double_precision", NULL};
+    PyObject *obj = (PyObject *) _obj;
 
-    char buffer[65536];
-    char *ret;
-    PyObject *newobj;
-    PyObject *oinput = NULL;
-    PyObject *oensureAscii = NULL;
-    int idoublePrecision = 10; // default double precision setting
+    if (GET_TC(tc)->dictObj)
+    {
+        return PyDict_Size(GET_TC(tc)->dictObj);
+    }
+    else
+    if (PyList_Check(obj))
+    {
+        return PyList_GET_SIZE(obj);
+    }
+    else
+    if (PyTuple_Check(obj))
+    {
+        return PyTuple_GET_SIZE(obj);
+    }
 
-    JSONObjectEncoder encoder = 
-    {
-        Object_beginTypeContext,    //void (*beginTypeContext)(JSOBJ obj, JSONTypeContext *tc);
-        Object_endTypeContext, //void (*endTypeContext)(JSOBJ obj, JSONTypeContext *tc);
-        Object_getStringValue, //const char *(*getStringValue)(JSOBJ obj, JSONTypeContext *tc, size_t *_outLen);
-        Object_getLongValue, //JSLONG (*getLongValue)(JSOBJ obj, JSONTypeContext *tc);
-        Object_getIntValue, //JSLONG (*getLongValue)(JSOBJ obj, JSONTypeContext *tc);
-        Object_getDoubleValue, //double (*getDoubleValue)(JSOBJ obj, JSONTypeContext *tc);
-        Object_iterBegin, //JSPFN_ITERBEGIN iterBegin;
-        Object_iterNext, //JSPFN_ITERNEXT iterNext;
-        Object_iterEnd, //JSPFN_ITEREND iterEnd;
-        Object_iterGetValue, //JSPFN_ITERGETVALUE iterGetValue;
-        Object_iterGetName, //JSPFN_ITERGETNAME iterGetName;
-        Object_releaseObject, //void (*releaseValue)(JSONTypeContext *ti);
-        PyObject_Malloc, //JSPFN_MALLOC malloc;
-        PyObject_Realloc, //JSPFN_REALLOC realloc;
-        PyObject_Free, //JSPFN_FREE free;
-        -1, //recursionMax
-        idoublePrecision,
-        1, //forceAscii
-    };
+    return 0;
+}
 
+/*
+Lists and tuples made up entirely of floats or entirely of ints are copied into a plain array
+so the encoder can format them in one go. Anything else (including subclasses, bools and ints
+that don't fit 64 bits) falls back to element by element encoding */
+#define BULK_MIN_ITEMS 8
 
-    PRINTMARK();
+int Object_iterGetBulk(JSOBJ _obj, JSONTypeContext *tc, const void **outValues, size_t *outCount)
+{
+    PyObject *obj = (PyObject *) _obj;
+    PyObject **items;
+    PyObject *item;
+    Py_ssize_t size;
+    Py_ssize_t index;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|Oi", kwlist, &oinput, &oensureAscii, &idoublePrecision))
+    if (PyList_Check(obj))
     {
-        return NULL;
+        items = ((PyListObject *) obj)->ob_item;
+        size = PyList_GET_SIZE(obj);
     }
-
-    
-    if (oensureAscii != NULL && !PyObject_IsTrue(oensureAscii))
+    else
+    if (PyTuple_Check(obj))
     {
-        encoder.forceASCII = 0;
+        items = ((PyTupleObject *) obj)->ob_item;
+        size = PyTuple_GET_SIZE(obj);
+    }
+    else
+    {
+        return JT_INVALID;
     }
 
-    encoder.doublePrecision = idoublePrecision;
-
-    PRINTMARK();
-    ret = JSON_EncodeObject (oinput, &encoder, buffer, sizeof (buffer));
-    PRINTMARK();
-
-    if (PyErr_Occurred())
+    if (size < BULK_MIN_ITEMS)
     {
-        return NULL;
+        return JT_INVALID;
     }
 
-    if (encoder.errorMsg)
+    if (PyFloat_CheckExact(items[0]))
     {
-        if (ret != buffer)
+        double *values = (double *) PyObject_Malloc(size * sizeof(double));
+        if (!values)
         {
-            encoder.free (ret);
+            return JT_INVALID;
         }
 
-        PyErr_Format (PyExc_OverflowError, "%s", encoder.errorMsg);
-        return NULL;
-    }
+        for (index = 0; index < size; index ++)
+        {
+            item = items[index];
+            if (!PyFloat_CheckExact(item))
+            {
+                PyObject_Free(values);
+                return JT_INVALID;
+            }
+            values[index] = PyFloat_AS_DOUBLE(item);
+        }
 
-    newobj = PyString_FromString (ret);
+        GET_TC(tc)->bulkValues = values;
+        *outValues = values;
+        *outCount = size;
+        return JT_DOUBLE;
+    }
 
-    if (ret != buffer)
+    if (PyLong_CheckExact(items[0]) || PyInt_CheckExact(items[0]))
     {
-        encoder.free (ret);
-    }
+        JSINT64 *values = (JSINT64 *) PyObject_Malloc(size * sizeof(JSINT64));
+        if (!values)
+        {
+            return JT_INVALID;
+        }
 
-    PRINTMARK();
+        for (index = 0; index < size; index ++)
+        {
+            item = items[index];
+            if (PyLong_CheckExact(item))
+            {
+                values[index] = PyLong_AsLongLong(item);
+                if (values[index] == -1 && PyErr_Occurred())
+                {
+                    PyErr_Clear();
+                    PyObject_Free(values);
+                    return JT_INVALID;
+                }
+            }
+            else
+            if (PyInt_CheckExact(item))
+            {
+                values[index] = PyInt_AS_LONG(item);
+            }
+            else
+            {
+                PyObject_Free(values);
+                return JT_INVALID;
+            }
+        }
 
-    return newobj;
+        GET_TC(tc)->bulkValues = values;
+        *outValues = values;
+        *outCount = size;
+        return JT_LONG;
+    }
+
+    return JT_INVALID;
 }
 
-PyObject* objToJSONFile(PyObject* self, PyObject *args, PyObject *kwargs)
+
+/*
+Output stream for JSON_EncodeObjectToStream which calls a Python write function with each chunk */
+typedef struct __PyWriteContext
 {
-    PyObject *data;
-    PyObject *file;
-    PyObject *string;
     PyObject *write;
-    PyObject *argtuple;
-
-    PRINTMARK();
+#if PY_MAJOR_VERSION >= 3
+    /* Chunks may end in the middle of a UTF-8 sequence, the partial sequence is carried over here */
+    char pending[4];
+    size_t cbPending;
+#endif
+} PyWriteContext;
 
-    if (!PyArg_ParseTuple (args, "OO", &data, &file)) {
-        return NULL;
-    }
+static int Stream_WriteString(PyWriteContext *ctx, const char *buffer, size_t cbBuffer)
+{
+    PyObject *string;
+    PyObject *result;
 
-    if (!PyObject_HasAttrString (file, "write"))
+    string = PyString_FromStringAndSize (buffer, cbBuffer);
+    if (string == NULL)
     {
-        PyErr_Format (PyExc_TypeError, "expected file");
-        return NULL;
+        return 0;
     }
 
-    write = PyObject_GetAttrString (file, "write");
+    result = PyObject_CallFunctionObjArgs (ctx->write, string, NULL);
+    Py_DECREF(string);
 
-    if (!PyCallable_Check (write)) {
-        Py_XDECREF(write);
-        PyErr_Format (PyExc_TypeError, "expected file");
-        return NULL;
+    if (result == NULL)
+    {
+        return 0;
     }
 
-    argtuple = PyTuple_Pack(1, data);
-
-    string = objToJSON (self, argtuple, kwargs);
+    Py_DECREF(result);
+    return 1;
+}
 
-    if (string == NULL)
-    {
-        Py_XDECREF(write);
-        Py_XDECREF(argtuple);
-        return NULL;
-    }
+static size_t Stream_Write(void *context, const char *buffer, size_t cbBuffer)
+{
+    PyWriteContext *ctx = (PyWriteContext *) context;
+    size_t cbWritten = cbBuffer;
 
-    Py_XDECREF(argtuple);
+#if PY_MAJOR_VERSION >= 3
+    size_t cbSequence;
+    size_t cbTail = 0;
+    size_t index;
 
-    argtuple = PyTuple_Pack (1, string);
-    if (argtuple == NULL)
-    {
-        Py_XDECREF(write);
-        return NULL;
-    }
-    if (PyObject_CallObject (write, argtuple) == NULL)
+    if (ctx->cbPending)
     {
-        Py_XDECREF(write);
-        Py_XDECREF(argtuple);
-        return NULL;
-    }
+        JSUINT8 lead = (JSUINT8) ctx->pending[0];
+        size_t cbMissing;
 
-    Py_XDECREF(write);
-    Py_DECREF(argtuple);
-    Py_XDECREF(string);
+        cbSequence = (lead >= 0xf0) ? 4 : (lead >= 0xe0) ? 3 : 2;
+        cbMissing = cbSequence - ctx->cbPending;
+        if (cbMissing > cbBuffer)
+        {
+            cbMissing = cbBuffer;
+        }
 
-    PRINTMARK();
+        memcpy (ctx->pending + ctx->cbPending, buffer, cbMissing);
+        ctx->cbPending += cbMissing;
+        buffer += cbMissing;
+        cbBuffer -= cbMissing;
 
-    Py_RETURN_NONE;
-    
+        if (ctx->cbPending < cbSequence)
+        {
+            return cbWritten;
+        }
 
-}
+        ctx->cbPending = 0;
+        if (!Stream_WriteString (ctx, ctx->pending, cbSequence))
+        {
+            return 0;
+        }
+    }
 
+    /*
+    Find the start of the last sequence and hold it back if it's incomplete */
+    for (index = 1; index <= 3 && index <= cbBuffer; index ++)
+    {
+        JSUINT8 chr = (JSUINT8) buffer[cbBuffer - index];
+
+        if (chr < 0x80)
+        {
+            break;
+        }
+
+        if (chr >= 0xc0)
+        {
+            cbSequence = (chr >= 0xf0) ? 4 : (chr >= 0xe0) ? 3 : 2;
+            if (index < cbSequence)
+            {
+                cbTail = index;
+            }
+            break;
+        }
+    }
+
+    memcpy (ctx->pending, buffer + cbBuffer - cbTail, cbTail);
+    ctx->cbPending = cbTail;
+    cbBuffer -= cbTail;
+#endif
+
+    if (cbBuffer > 0 && !Stream_WriteString (ctx, buffer, cbBuffer))
+    {
+        return 0;
+    }
+
+    return cbWritten;
+}
+
+#if PY_MAJOR_VERSION < 3
+/*
+Joins the segments of JSON_EncodeObjectToIOVec into a string. Large str values are referenced
+by the segments so they are only copied once, straight into the result */
+static PyObject* IOVec_ToString(JSONIOVec *iovec)
+{
+    PyObject *newobj;
+    size_t cbTotal = 0;
+    size_t index;
+    char *of;
+
+    if (iovec->count == 1)
+    {
+        return PyString_FromStringAndSize ((const char *) iovec->segments[0].base, iovec->segments[0].length);
+    }
+
+    for (index = 0; index < iovec->count; index ++)
+    {
+        cbTotal += iovec->segments[index].length;
+    }
+
+    newobj = PyString_FromStringAndSize (NULL, cbTotal);
+    if (!newobj)
+    {
+        return NULL;
+    }
+    of = PyString_AS_STRING(newobj);
+
+    for (index = 0; index < iovec->count; index ++)
+    {
+        memcpy (of, iovec->segments[index].base, iovec->segments[index].length);
+        of += iovec->segments[index].length;
+    }
+
+    return newobj;
+}
+#endif
+
+/*
+Encodes each object of the sequence seq with JSON_EncodeBatch. Returns a list with the JSON
+string of each object or, when separator is given, a single string of all objects each
+followed by separator */
+static PyObject* encodeBatch(PyObject *seq, JSONObjectEncoder *encoder, PyObject *separator, char *buffer, size_t cbBuffer)
+{
+    PyObject *fast;
+    PyObject *utf8 = NULL;
+    PyObject *newobj = NULL;
+    const char *sep = NULL;
+    size_t cbSep = 0;
+    size_t *offsets;
+    size_t index;
+    size_t count;
+    char *ret;
+
+    fast = PySequence_Fast (seq, "expected a sequence of objects to encode");
+    if (fast == NULL)
+    {
+        return NULL;
+    }
+
+    if (separator != NULL && separator != Py_None)
+    {
+        if (PyUnicode_Check(separator))
+        {
+            utf8 = PyUnicode_AsUTF8String (separator);
+            if (utf8 == NULL)
+            {
+                Py_DECREF(fast);
+                return NULL;
+            }
+            separator = utf8;
+        }
+
+        if (!PyString_Check(separator))
+        {
+            Py_XDECREF(utf8);
+            Py_DECREF(fast);
+            PyErr_Format (PyExc_TypeError, "separator must be a string");
+            return NULL;
+        }
+
+        sep = PyString_AS_STRING(separator);
+        cbSep = PyString_GET_SIZE(separator);
+    }
+
+    count = PySequence_Fast_GET_SIZE(fast);
+    offsets = (size_t *) PyObject_Malloc ((count + 1) * sizeof (size_t));
+    if (offsets == NULL)
+    {
+        Py_XDECREF(utf8);
+        Py_DECREF(fast);
+        return PyErr_NoMemory();
+    }
+
+    PRINTMARK();
+    ret = JSON_EncodeBatch ((JSOBJ *) PySequence_Fast_ITEMS(fast), count, encoder, sep, cbSep, offsets, buffer, cbBuffer);
+    PRINTMARK();
+
+    if (PyErr_Occurred())
+    {
+        goto END;
+    }
+
+    if (encoder->errorMsg)
+    {
+        PyErr_Format (PyExc_OverflowError, "%s", encoder->errorMsg);
+        goto END;
+    }
+
+    if (sep != NULL)
+    {
+        newobj = PyString_FromStringAndSize (ret, offsets[count]);
+        goto END;
+    }
+
+    newobj = PyList_New (count);
+    if (newobj == NULL)
+    {
+        goto END;
+    }
+
+    for (index = 0; index < count; index ++)
+    {
+        PyObject *item = PyString_FromStringAndSize (ret + offsets[index], offsets[index + 1] - offsets[index]);
+        if (item == NULL)
+        {
+            Py_DECREF(newobj);
+            newobj = NULL;
+            goto END;
+        }
+        PyList_SET_ITEM (newobj, index, item);
+    }
+
+END:
+    if (ret != NULL && ret != buffer)
+    {
+        encoder->free (ret);
+    }
+    PyObject_Free (offsets);
+    Py_XDECREF(utf8);
+    Py_DECREF(fast);
+    return newobj;
+}
+
+#ifdef JSON_WITH_ZLIB
+/*
+Collects the compressed output of JSON_EncodeObjectToDeflate */
+typedef struct __PyDeflateOutput
+{
+    char *data;
+    size_t cbData;
+    size_t capacity;
+} PyDeflateOutput;
+
+static size_t Deflate_Collect(void *context, const char *buffer, size_t cbBuffer)
+{
+    PyDeflateOutput *output = (PyDeflateOutput *) context;
+    size_t newCapacity;
+    char *data;
+
+    if (output->cbData + cbBuffer > output->capacity)
+    {
+        newCapacity = output->capacity ? output->capacity * 2 : 65536;
+        while (newCapacity < output->cbData + cbBuffer)
+        {
+            newCapacity *= 2;
+        }
+
+        data = (char *) PyObject_Realloc (output->data, newCapacity);
+        if (!data)
+        {
+            return 0;
+        }
+
+        output->data = data;
+        output->capacity = newCapacity;
+    }
+
+    memcpy (output->data + output->cbData, buffer, cbBuffer);
+    output->cbData += cbBuffer;
+    return cbBuffer;
+}
+
+/*
+Encodes obj straight into gzip compressed bytes at compression level olevel */
+static PyObject* encodeDeflate(PyObject *obj, JSONObjectEncoder *encoder, PyObject *olevel, char *buffer, size_t cbBuffer)
+{
+    PyDeflateOutput output = { NULL, 0, 0 };
+    PyObject *newobj = NULL;
+    long level = Z_DEFAULT_COMPRESSION;
+
+    if (olevel != NULL && olevel != Py_None)
+    {
+        level = PyLong_AsLong (olevel);
+        if (level == -1 && PyErr_Occurred())
+        {
+            return NULL;
+        }
+
+        if (level < -1 || level > 9)
+        {
+            PyErr_Format (PyExc_ValueError, "level must be between 0 and 9");
+            return NULL;
+        }
+    }
+
+    PRINTMARK();
+    JSON_EncodeObjectToDeflate (obj, encoder, (int) level, 15 + 16, Deflate_Collect, &output, buffer, cbBuffer);
+    PRINTMARK();
+
+    if (!PyErr_Occurred())
+    {
+        if (encoder->errorMsg)
+        {
+            PyErr_Format (PyExc_OverflowError, "%s", encoder->errorMsg);
+        }
+        else
+        {
+            newobj = PyBytes_FromStringAndSize (output.data, output.cbData);
+        }
+    }
+
+    PyObject_Free (output.data);
+    return newobj;
+}
+#endif
+
+static const JSONObjectEncoder g_encoderDefaults =
+{
+    Object_beginTypeContext,    //void (*beginTypeContext)(JSOBJ obj, JSONTypeContext *tc);
+    Object_endTypeContext, //void (*endTypeContext)(JSOBJ obj, JSONTypeContext *tc);
+    Object_getStringValue, //const char *(*getStringValue)(JSOBJ obj, JSONTypeContext *tc, size_t *_outLen);
+    Object_getLongValue, //JSLONG (*getLongValue)(JSOBJ obj, JSONTypeContext *tc);
+    Object_getIntValue, //JSLONG (*getLongValue)(JSOBJ obj, JSONTypeContext *tc);
+    Object_getDoubleValue, //double (*getDoubleValue)(JSOBJ obj, JSONTypeContext *tc);
+    Object_iterBegin, //JSPFN_ITERBEGIN iterBegin;
+    Object_iterNext, //JSPFN_ITERNEXT iterNext;
+    Object_iterEnd, //JSPFN_ITEREND iterEnd;
+    Object_iterGetValue, //JSPFN_ITERGETVALUE iterGetValue;
+    Object_iterGetName, //JSPFN_ITERGETNAME iterGetName;
+    Object_releaseObject, //void (*releaseValue)(JSONTypeContext *ti);
+    PyObject_Malloc, //JSPFN_MALLOC malloc;
+    PyObject_Realloc, //JSPFN_REALLOC realloc;
+    PyObject_Free, //JSPFN_FREE free;
+    -1, //recursionMax
+    10, //doublePrecision
+    1, //forceAscii
+    NULL, //errorMsg
+    NULL, //errorObj
+    0, //doubleShortest
+    Object_iterGetBulk, //JSPFN_ITERGETBULK iterGetBulk;
+    Object_holdString, //JSPFN_HOLDSTRING holdString;
+    0, //sortKeys
+    0, //canonical
+    Object_getValue, //JSPFN_GETVALUE getValue;
+    NULL, //JSPFN_MEMOIZE memoize;
+    Object_iterSizeHint, //JSPFN_ITERSIZEHINT iterSizeHint;
+    NULL, //JSONHash *hash;
+    Object_getDecimalValue, //JSINT64 (*getDecimalValue)(JSOBJ obj, JSONTypeContext *tc, int *outScale);
+};
+
+/*
+Applies the keyword options shared by encode and Template */
+static void Encoder_SetOptions(JSONObjectEncoder *encoder, PyObject *oensureAscii, int idoublePrecision, PyObject *odoubleShortest, PyObject *osortKeys, PyObject *ocanonical, PyObject *omemoize)
+{
+    if (oensureAscii != NULL && !PyObject_IsTrue(oensureAscii))
+    {
+        encoder->forceASCII = 0;
+    }
+
+    if (odoubleShortest != NULL && PyObject_IsTrue(odoubleShortest))
+    {
+        encoder->doubleShortest = 1;
+    }
+
+    if (osortKeys != NULL && PyObject_IsTrue(osortKeys))
+    {
+        encoder->sortKeys = 1;
+    }
+
+    if (ocanonical != NULL && PyObject_IsTrue(ocanonical))
+    {
+        encoder->sortKeys = 1;
+        encoder->canonical = 1;
+    }
+
+    if (omemoize != NULL && PyObject_IsTrue(omemoize))
+    {
+        encoder->memoize = Object_memoize;
+    }
+
+    encoder->doublePrecision = idoublePrecision;
+}
+
+#define ENCODE_STRING   0
+#define ENCODE_STREAM   1
+#define ENCODE_BATCH    2
+#define ENCODE_DEFLATE  3
+#define ENCODE_HASH     4
+
+/*
+Encodes the object in args. Depending on mode returns the JSON string (ENCODE_STRING), streams
+the output to the write function modeArg and returns None (ENCODE_STREAM), encodes the sequence
+with encodeBatch using modeArg as separator (ENCODE_BATCH), returns gzip compressed JSON
+using modeArg as compression level (ENCODE_DEFLATE) or returns the JSON string together with
+the XXH64 digest of its UTF-8 encoding using modeArg as seed (ENCODE_HASH) */
+static PyObject* encodeObject(PyObject *args, PyObject *kwargs, int mode, PyObject *modeArg)
+{
+    static char *kwlist[] = { "obj", "ensure_ascii", "double_precision", "double_shortest", "sort_keys", "canonical", "memoize", NULL};
+
+    char buffer[65536];
+#if PY_MAJOR_VERSION >= 3
+    char *ret;
+#else
+    JSONIOVec iovec;
+#endif
+    JSONHash hash;
+    JSUINT64 seed;
+    PyObject *newobj;
+    PyObject *oinput = NULL;
+    PyObject *oensureAscii = NULL;
+    PyObject *odoubleShortest = NULL;
+    PyObject *osortKeys = NULL;
+    PyObject *ocanonical = NULL;
+    PyObject *omemoize = NULL;
+    int idoublePrecision = 10; // default double precision setting
+
+    JSONObjectEncoder encoder = g_encoderDefaults;
+
+
+    PRINTMARK();
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OiOOOO", kwlist, &oinput, &oensureAscii, &idoublePrecision, &odoubleShortest, &osortKeys, &ocanonical, &omemoize))
+    {
+        return NULL;
+    }
+
+    
+    Encoder_SetOptions (&encoder, oensureAscii, idoublePrecision, odoubleShortest, osortKeys, ocanonical, omemoize);
+
+    if (mode == ENCODE_BATCH)
+    {
+        return encodeBatch (oinput, &encoder, modeArg, buffer, sizeof (buffer));
+    }
+
+#ifdef JSON_WITH_ZLIB
+    if (mode == ENCODE_DEFLATE)
+    {
+        return encodeDeflate (oinput, &encoder, modeArg, buffer, sizeof (buffer));
+    }
+#endif
+
+    if (mode == ENCODE_STREAM)
+    {
+        PyWriteContext ctx;
+        ctx.write = modeArg;
+#if PY_MAJOR_VERSION >= 3
+        ctx.cbPending = 0;
+#endif
+
+        PRINTMARK();
+        JSON_EncodeObjectToStream (oinput, &encoder, Stream_Write, &ctx, buffer, sizeof (buffer));
+        PRINTMARK();
+
+        if (PyErr_Occurred())
+        {
+            return NULL;
+        }
+
+        if (encoder.errorMsg)
+        {
+            PyErr_Format (PyExc_OverflowError, "%s", encoder.errorMsg);
+            return NULL;
+        }
+
+        Py_RETURN_NONE;
+    }
+
+    if (mode == ENCODE_HASH)
+    {
+        seed = 0;
+
+        if (modeArg != NULL)
+        {
+            PyObject *seedLong = PyNumber_Long(modeArg);
+            if (seedLong == NULL)
+            {
+                return NULL;
+            }
+
+            seed = PyLong_AsUnsignedLongLong(seedLong);
+            Py_DECREF(seedLong);
+
+            if (PyErr_Occurred())
+            {
+                return NULL;
+            }
+        }
+
+        JSON_HashInit (&hash, seed);
+        encoder.hash = &hash;
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    /*
+    A str is decoded from the output, which copies all of it anyway, so referencing large strings in
+    place as below would only add a copy. Encode into one buffer */
+    PRINTMARK();
+    ret = JSON_EncodeObject (oinput, &encoder, buffer, sizeof (buffer));
+    PRINTMARK();
+
+    if (PyErr_Occurred() || encoder.errorMsg)
+    {
+        if (ret != buffer)
+        {
+            encoder.free (ret);
+        }
+
+        if (!PyErr_Occurred())
+        {
+            PyErr_Format (PyExc_OverflowError, "%s", encoder.errorMsg);
+        }
+        return NULL;
+    }
+
+    newobj = PyString_FromString (ret);
+
+    if (ret != buffer)
+    {
+        encoder.free (ret);
+    }
+#else
+    PRINTMARK();
+    JSON_EncodeObjectToIOVec (oinput, &encoder, 0, &iovec, buffer, sizeof (buffer));
+    PRINTMARK();
+
+    if (PyErr_Occurred())
+    {
+        JSON_FreeIOVec (&encoder, &iovec);
+        return NULL;
+    }
+
+    if (encoder.errorMsg)
+    {
+        PyErr_Format (PyExc_OverflowError, "%s", encoder.errorMsg);
+        return NULL;
+    }
+
+    newobj = IOVec_ToString (&iovec);
+    JSON_FreeIOVec (&encoder, &iovec);
+#endif
+
+    PRINTMARK();
+
+    if (mode == ENCODE_HASH && newobj != NULL)
+    {
+        return Py_BuildValue ("(NN)", newobj, PyLong_FromUnsignedLongLong (JSON_HashDigest (&hash)));
+    }
+
+    return newobj;
+}
+
+PyObject* objToJSON(PyObject* self, PyObject *args, PyObject *kwargs)
+{
+    return encodeObject (args, kwargs, ENCODE_STRING, NULL);
+}
+
+PyObject* objToJSONFile(PyObject* self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *data;
+    PyObject *file;
+    PyObject *result;
+    PyObject *write;
+    PyObject *argtuple;
+
+    PRINTMARK();
+
+    if (!PyArg_ParseTuple (args, "OO", &data, &file)) {
+        return NULL;
+    }
+
+    if (!PyObject_HasAttrString (file, "write"))
+    {
+        PyErr_Format (PyExc_TypeError, "expected file");
+        return NULL;
+    }
+
+    write = PyObject_GetAttrString (file, "write");
+
+    if (!PyCallable_Check (write)) {
+        Py_XDECREF(write);
+        PyErr_Format (PyExc_TypeError, "expected file");
+        return NULL;
+    }
+
+    argtuple = PyTuple_Pack(1, data);
+    if (argtuple == NULL)
+    {
+        Py_XDECREF(write);
+        return NULL;
+    }
+
+    result = encodeObject (argtuple, kwargs, ENCODE_STREAM, write);
+
+    Py_XDECREF(write);
+    Py_DECREF(argtuple);
+
+    PRINTMARK();
+
+    return result;
+}
+
+/*
+Calls encodeObject with keyword argument name taken out of kwargs and passed on as modeArg */
+static PyObject* encodeObjectWithKeyword(PyObject *args, PyObject *kwargs, int mode, const char *name)
+{
+    PyObject *value;
+    PyObject *result;
+
+    if (kwargs == NULL || (value = PyDict_GetItemString (kwargs, name)) == NULL)
+    {
+        return encodeObject (args, kwargs, mode, NULL);
+    }
+
+    kwargs = PyDict_Copy (kwargs);
+    if (kwargs == NULL)
+    {
+        return NULL;
+    }
+
+    Py_INCREF(value);
+    PyDict_DelItemString (kwargs, name);
+    result = encodeObject (args, kwargs, mode, value);
+    Py_DECREF(value);
+    Py_DECREF(kwargs);
+    return result;
+}
+
+PyObject* objToJSONBatch(PyObject* self, PyObject *args, PyObject *kwargs)
+{
+    PRINTMARK();
+    return encodeObjectWithKeyword (args, kwargs, ENCODE_BATCH, "separator");
+}
+
+PyObject* objToJSONHashed(PyObject* self, PyObject *args, PyObject *kwargs)
+{
+    PRINTMARK();
+    return encodeObjectWithKeyword (args, kwargs, ENCODE_HASH, "seed");
+}
+
+#ifdef JSON_WITH_ZLIB
+PyObject* objToJSONGzip(PyObject* self, PyObject *args, PyObject *kwargs)
+{
+    PRINTMARK();
+    return encodeObjectWithKeyword (args, kwargs, ENCODE_DEFLATE, "level");
+}
+#endif
+
+/*
+ujson.Template, a JSON skeleton compiled once and filled with values through JSON_TemplateBind* */
+typedef struct __PyTemplate
+{
+    PyObject_HEAD
+    JSONObjectEncoder encoder;
+    JSONTemplate tmpl;
+} PyTemplate;
+
+/*
+Returns a new reference to the UTF-8 bytes of a str or unicode object or NULL with TypeError set */
+static PyObject* Template_ToUTF8(PyObject *obj, const char *what)
+{
+    if (PyUnicode_Check(obj))
+    {
+        return PyUnicode_AsUTF8String (obj);
+    }
+
+    if (PyString_Check(obj))
+    {
+        Py_INCREF(obj);
+        return obj;
+    }
+
+    PyErr_Format (PyExc_TypeError, "%s must be a string", what);
+    return NULL;
+}
+
+static int Template_init(PyTemplate *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = { "text", "ensure_ascii", "double_precision", "double_shortest", "sort_keys", "canonical", "memoize", NULL};
+
+    PyObject *otext = NULL;
+    PyObject *utf8;
+    PyObject *oensureAscii = NULL;
+    PyObject *odoubleShortest = NULL;
+    PyObject *osortKeys = NULL;
+    PyObject *ocanonical = NULL;
+    PyObject *omemoize = NULL;
+    int idoublePrecision = 10;
+    int result;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OiOOOO", kwlist, &otext, &oensureAscii, &idoublePrecision, &odoubleShortest, &osortKeys, &ocanonical, &omemoize))
+    {
+        return -1;
+    }
+
+    utf8 = Template_ToUTF8 (otext, "text");
+    if (utf8 == NULL)
+    {
+        return -1;
+    }
+
+    JSON_FreeTemplate (&self->encoder, &self->tmpl);
+    self->encoder = g_encoderDefaults;
+    Encoder_SetOptions (&self->encoder, oensureAscii, idoublePrecision, odoubleShortest, osortKeys, ocanonical, omemoize);
+
+    result = JSON_CompileTemplate (&self->encoder, &self->tmpl, PyString_AS_STRING(utf8), PyString_GET_SIZE(utf8));
+    Py_DECREF(utf8);
+
+    if (!result)
+    {
+        PyErr_Format (PyExc_ValueError, "%s", self->encoder.errorMsg);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void Template_dealloc(PyTemplate *self)
+{
+    JSON_FreeTemplate (&self->encoder, &self->tmpl);
+    Py_TYPE(self)->tp_free ((PyObject *) self);
+}
+
+/*
+Binds one value to the next hole, converting it as the hole's type asks */
+static int Template_bindValue(JSONEncodeState *es, int hole, PyObject *value)
+{
+    PyObject *utf8;
+    JSINT64 longValue;
+    double doubleValue;
+    int result;
+
+    switch (hole)
+    {
+        case JTH_LONG:
+            if (!PyInt_Check(value) && !PyLong_Check(value))
+            {
+                PyErr_Format (PyExc_TypeError, "<int> hole expects an integer");
+                return 0;
+            }
+            longValue = PyLong_AsLongLong (value);
+            if (longValue == -1 && PyErr_Occurred())
+            {
+                return 0;
+            }
+            return JSON_TemplateBindLong (es, longValue);
+
+        case JTH_DOUBLE:
+            doubleValue = PyFloat_AsDouble (value);
+            if (doubleValue == -1.0 && PyErr_Occurred())
+            {
+                return 0;
+            }
+            return JSON_TemplateBindDouble (es, doubleValue);
+
+        case JTH_UTF8:
+        case JTH_RAW:
+            utf8 = Template_ToUTF8 (value, hole == JTH_UTF8 ? "<str> hole value" : "<raw> hole value");
+            if (utf8 == NULL)
+            {
+                return 0;
+            }
+
+            if (hole == JTH_UTF8)
+            {
+                result = JSON_TemplateBindString (es, PyString_AS_STRING(utf8), PyString_GET_SIZE(utf8));
+            }
+            else
+            {
+                result = JSON_TemplateBindRaw (es, PyString_AS_STRING(utf8), PyString_GET_SIZE(utf8));
+            }
+            Py_DECREF(utf8);
+            return result;
+
+        default:
+            return JSON_TemplateBindObject (es, value);
+    }
+}
+
+static PyObject* Template_encode(PyTemplate *self, PyObject *args)
+{
+    char buffer[65536];
+    char *ret;
+    size_t cbOutput;
+    PyObject *newobj;
+    Py_ssize_t index;
+
+    /*
+    Each call has a state of its own, a <value> hole may run Python code which fills this same template */
+    JSONEncodeState es;
+    es.hash = NULL;
+
+    if (self->tmpl.chunks == NULL)
+    {
+        PyErr_Format (PyExc_ValueError, "template is not initialized");
+        return NULL;
+    }
+
+    if ((size_t) PyTuple_GET_SIZE(args) != self->tmpl.holeCount)
+    {
+        PyErr_Format (PyExc_TypeError, "template has %d holes (%d values given)", (int) self->tmpl.holeCount, (int) PyTuple_GET_SIZE(args));
+        return NULL;
+    }
+
+    if (JSON_TemplateBegin (&self->encoder, &es, &self->tmpl, buffer, sizeof (buffer)))
+    {
+        for (index = 0; index < PyTuple_GET_SIZE(args); index ++)
+        {
+            if (!Template_bindValue (&es, self->tmpl.chunks[index].hole, PyTuple_GET_ITEM(args, index)))
+            {
+                break;
+            }
+        }
+    }
+
+    ret = JSON_TemplateEnd (&es, &cbOutput);
+
+    if (PyErr_Occurred())
+    {
+        if (ret != NULL && ret != buffer)
+        {
+            self->encoder.free (ret);
+        }
+        return NULL;
+    }
+
+    if (ret == NULL)
+    {
+        PyErr_Format (PyExc_OverflowError, "%s", es.errorMsg);
+        return NULL;
+    }
+
+    newobj = PyString_FromStringAndSize (ret, cbOutput);
+
+    if (ret != buffer)
+    {
+        self->encoder.free (ret);
+    }
+
+    return newobj;
+}
+
+static PyObject* Template_call(PyTemplate *self, PyObject *args, PyObject *kwargs)
+{
+    if (kwargs != NULL && PyDict_Size (kwargs) > 0)
+    {
+        PyErr_Format (PyExc_TypeError, "template values are positional only");
+        return NULL;
+    }
+
+    return Template_encode (self, args);
+}
+
+static PyObject* Template_holes(PyTemplate *self, void *closure)
+{
+    return PyInt_FromLong ((long) self->tmpl.holeCount);
+}
+
+static PyMethodDef Template_methods[] = {
+    {"encode", (PyCFunction) Template_encode, METH_VARARGS, "Fills the holes in order with the given values and returns the JSON string"},
+    {NULL, NULL, 0, NULL}       /* Sentinel */
+};
+
+static PyGetSetDef Template_getset[] = {
+    {"holes", (getter) Template_holes, NULL, "Number of holes", NULL},
+    {NULL, NULL, NULL, NULL, NULL}  /* Sentinel */
+};
+
+PyTypeObject TemplateType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "ujson.Template",           /* tp_name */
+    sizeof (PyTemplate),        /* tp_basicsize */
+    0,                          /* tp_itemsize */
+    (destructor) Template_dealloc, /* tp_dealloc */
+    0,                          /* tp_print */
+    0,                          /* tp_getattr */
+    0,                          /* tp_setattr */
+    0,                          /* tp_compare */
+    0,                          /* tp_repr */
+    0,                          /* tp_as_number */
+    0,                          /* tp_as_sequence */
+    0,                          /* tp_as_mapping */
+    0,                          /* tp_hash */
+    (ternaryfunc) Template_call, /* tp_call */
+    0,                          /* tp_str */
+    0,                          /* tp_getattro */
+    0,                          /* tp_setattro */
+    0,                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,         /* tp_flags */
+    "Template(text, **options) compiles a JSON skeleton with typed holes <int>, <double>, <str>, <raw> and <value> "
+    "outside of strings, eg. Template('{\"id\":<int>,\"items\":<raw>}'). Calling it or its encode method with one "
+    "value per hole returns the filled in JSON string. Takes the same options as encode", /* tp_doc */
+    0,                          /* tp_traverse */
+    0,                          /* tp_clear */
+    0,                          /* tp_richcompare */
+    0,                          /* tp_weaklistoffset */
+    0,                          /* tp_iter */
+    0,                          /* tp_iternext */
+    Template_methods,           /* tp_methods */
+    0,                          /* tp_members */
+    Template_getset,            /* tp_getset */
+    0,                          /* tp_base */
+    0,                          /* tp_dict */
+    0,                          /* tp_descr_get */
+    0,                          /* tp_descr_set */
+    0,                          /* tp_dictoffset */
+    (initproc) Template_init,   /* tp_init */
+    0,                          /* tp_alloc */
+    PyType_GenericNew,          /* tp_new */
+};
@@ -40,6 +40,7 @@ http://www.opensource.apple.com/source/tcl/tcl-14/tcl/license.terms
 #if PY_MAJOR_VERSION >= 3
 
 #define PyInt_Check             PyLong_Check
+#define PyInt_CheckExact        PyLong_CheckExact
 #define PyInt_AS_LONG           PyLong_AsLong
 #define PyInt_FromLong          PyLong_FromLong
 
@@ -48,5 +49,6 @@ http://www.opensource.apple.com/source/tcl/tcl-14/tcl/license.terms
 #define PyString_AS_STRING      PyBytes_AS_STRING
 
 #define PyString_FromString     PyUnicode_FromString
+#define PyString_FromStringAndSize PyUnicode_FromStringAndSize
 
 #endif
@@ -48,17 +48,36 @@ PyObject* JSONToObj(PyObject* self, PyObject *arg);
 /* objToJSONFile */
 PyObject* objToJSONFile(PyObject* self, PyObject *args, PyObject *kwargs);
 
+/* objToJSONBatch */
+PyObject* objToJSONBatch(PyObject* self, PyObject *args, PyObject *kwargs);
+
+/* objToJSONHashed */
+PyObject* objToJSONHashed(PyObject* self, PyObject *args, PyObject *kwargs);
+
+#ifdef JSON_WITH_ZLIB
+/* objToJSONGzip */
+PyObject* objToJSONGzip(PyObject* self, PyObject *args, PyObject *kwargs);
+#endif
+
+/* Template */
+extern PyTypeObject TemplateType;
+
 /* JSONFileToObj */
 PyObject* JSONFileToObj(PyObject* self, PyObject *file);
 
 
 static PyMethodDef ujsonMethods[] = {
-    {"encode", (PyCFunction) objToJSON, METH_VARARGS | METH_KEYWORDS, "Converts arbitrary object recursivly into JSON. Use ensure_ascii=false to output UTF-8. Pass in double_precision to alter the maximum digit precision with doubles"},
+    {"encode", (PyCFunction) objToJSON, METH_VARARGS | METH_KEYWORDS, "Converts arbitrary object recursivly into JSON. Use ensure_ascii=false to output UTF-8. Pass in double_precision to alter the maximum digit precision with doubles or double_shortest=True to output a short representation that round trips (Grisu2, occasionally one digit longer than the shortest). Use sort_keys=True to output dict keys in byte-wise order of their UTF-8 encoding or canonical=True to also normalize numbers so equal data always gives the same output (keys that give the same name, such as 1 and '1', raise ValueError). Pass memoize=True to encode dicts, lists and tuples that appear several times in the document only once and copy their output. Objects with a __json__ method returning a string of JSON are embedded as is"},
     {"decode", (PyCFunction) JSONToObj, METH_O, "Converts JSON as string to dict object structure"},
     {"dumps", (PyCFunction) objToJSON, METH_VARARGS | METH_KEYWORDS,  "Converts arbitrary object recursivly into JSON. Use ensure_ascii=false to output UTF-8"},
     {"loads", (PyCFunction) JSONToObj, METH_O,  "Converts JSON as string to dict object structure"},
     {"dump", (PyCFunction) objToJSONFile, METH_VARARGS | METH_KEYWORDS, "Converts arbitrary object recursively into JSON file. Use ensure_ascii=false to output UTF-8"},
     {"load", (PyCFunction) JSONFileToObj, METH_O, "Converts JSON as file to dict object structure"},
+    {"encode_batch", (PyCFunction) objToJSONBatch, METH_VARARGS | METH_KEYWORDS, "Converts each object of a sequence into JSON in one pass. Returns a list of JSON strings or, with separator given (eg. '\\n'), one string with each document followed by separator. Takes the same options as encode"},
+    {"encode_hashed", (PyCFunction) objToJSONHashed, METH_VARARGS | METH_KEYWORDS, "Converts arbitrary object recursively into JSON and returns it together with the XXH64 digest of its UTF-8 encoding (eg. for an ETag), hashed while encoding. Pass in seed to seed the hash. Takes the same options as encode"},
+#ifdef JSON_WITH_ZLIB
+    {"encode_gzip", (PyCFunction) objToJSONGzip, METH_VARARGS | METH_KEYWORDS, "Converts arbitrary object recursively into gzip compressed JSON bytes, compressing while encoding. Pass in level (0-9) to set the compression level. Takes the same options as encode"},
+#endif
     {NULL, NULL, 0, NULL}       /* Sentinel */
 };
 
@@ -104,6 +123,14 @@ PYMODINITFUNC
     version_string = PyString_FromString (UJSON_VERSION);
     PyModule_AddObject (module, "__version__", version_string);
 
+    if (PyType_Ready (&TemplateType) < 0)
+    {
+        MODINITERROR;
+    }
+
+    Py_INCREF(&TemplateType);
+    PyModule_AddObject (module, "Template", (PyObject *) &TemplateType);
+
 #if PY_MAJOR_VERSION >= 3
     return module;
 #endif
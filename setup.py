@@ -24,6 +24,39 @@ try:
 except(OSError):
     pass
 
+def has_zlib():
+    """Checks whether zlib's header and library can be used to build with JSON_WITH_ZLIB"""
+    import tempfile
+    from distutils.ccompiler import new_compiler
+    from distutils.errors import CompileError, LinkError
+    from distutils.sysconfig import customize_compiler
+
+    tmpdir = tempfile.mkdtemp()
+    try:
+        source = os.path.join(tmpdir, 'zlibcheck.c')
+        f = open(source, 'w')
+        try:
+            f.write('#include <zlib.h>\nint main(void) { return deflateEnd(0) == Z_OK; }\n')
+        finally:
+            f.close()
+        compiler = new_compiler()
+        customize_compiler(compiler)
+        try:
+            objects = compiler.compile([source], output_dir=tmpdir)
+            compiler.link_executable(objects, os.path.join(tmpdir, 'zlibcheck'), libraries=['z'])
+        except (CompileError, LinkError):
+            return False
+        return True
+    finally:
+        shutil.rmtree(tmpdir, True)
+
+define_macros = []
+libraries = []
+
+if has_zlib():
+    define_macros.append(('JSON_WITH_ZLIB', None))
+    libraries.append('z')
+
 module1 = Extension('ujson',
                     sources = ['./python/ujson.c', 
                                './python/objToJSON.c', 
@@ -31,6 +64,8 @@ module1 = Extension('ujson',
                                './lib/ultrajsonenc.c', 
                                './lib/ultrajsondec.c'],
                     include_dirs = ['./python', './lib'],
+                    define_macros = define_macros,
+                    libraries = libraries,
                     extra_compile_args=['-D_GNU_SOURCE'])
 
 def get_version():
@@ -0,0 +1,518 @@
+/*
+Tests for the parts of the encoder the Python extension doesn't reach: the buffer pool
+(JSON_PoolMalloc and friends) and JSON_EncodeObjectParallel. Not built by setup.py, run with
+
+    gcc -O2 -Ilib tests/ctests.c lib/ultrajsonenc.c -lm -lpthread -o ctests && ./ctests
+
+Add -fsanitize=thread or -fsanitize=address to check the pool's slots and thread caches. The tests start
+threads of their own, don't build them with JSON_NO_THREADS */
+
+#include "ultrajson.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+static int g_failures = 0;
+
+#define CHECK(__cond) \
+    if (!(__cond)) \
+    { \
+        fprintf (stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #__cond); \
+        g_failures ++; \
+    }
+
+/*
+A document tree standing in for the objects of a binding */
+typedef struct __TestNode
+{
+    int type;
+    JSINT64 longValue;
+    double doubleValue;
+    const char *stringValue;
+    int count;
+    struct __TestNode *items;
+    const char **names;
+} TestNode;
+
+static const char *g_names[] = { "alpha", "beta", "gamma", "d\xc3\xa9lta", "eps\"ilon", "zeta", "eta", "theta" };
+
+static volatile int g_begun = 0;
+static volatile int g_ended = 0;
+
+static void Test_beginTypeContext(JSOBJ obj, JSONTypeContext *tc)
+{
+    tc->type = ((TestNode *) obj)->type;
+    tc->prv = malloc (sizeof (int));
+}
+
+static void Test_endTypeContext(JSOBJ obj, JSONTypeContext *tc)
+{
+    free (tc->prv);
+}
+
+static void Test_beginTypeContextCounted(JSOBJ obj, JSONTypeContext *tc)
+{
+    g_begun ++;
+    Test_beginTypeContext (obj, tc);
+}
+
+static void Test_endTypeContextCounted(JSOBJ obj, JSONTypeContext *tc)
+{
+    g_ended ++;
+    Test_endTypeContext (obj, tc);
+}
+
+static const char *Test_getStringValue(JSOBJ obj, JSONTypeContext *tc, size_t *_outLen)
+{
+    *_outLen = strlen (((TestNode *) obj)->stringValue);
+    return ((TestNode *) obj)->stringValue;
+}
+
+static JSINT64 Test_getLongValue(JSOBJ obj, JSONTypeContext *tc)
+{
+    return ((TestNode *) obj)->longValue;
+}
+
+static JSINT32 Test_getIntValue(JSOBJ obj, JSONTypeContext *tc)
+{
+    return (JSINT32) ((TestNode *) obj)->longValue;
+}
+
+static double Test_getDoubleValue(JSOBJ obj, JSONTypeContext *tc)
+{
+    return ((TestNode *) obj)->doubleValue;
+}
+
+static void Test_iterBegin(JSOBJ obj, JSONTypeContext *tc)
+{
+    *((int *) tc->prv) = -1;
+}
+
+static int Test_iterNext(JSOBJ obj, JSONTypeContext *tc)
+{
+    return ++ *((int *) tc->prv) < ((TestNode *) obj)->count;
+}
+
+static void Test_iterEnd(JSOBJ obj, JSONTypeContext *tc)
+{
+}
+
+static JSOBJ Test_iterGetValue(JSOBJ obj, JSONTypeContext *tc)
+{
+    return &((TestNode *) obj)->items[*((int *) tc->prv)];
+}
+
+static char *Test_iterGetName(JSOBJ obj, JSONTypeContext *tc, size_t *outLen)
+{
+    const char *name = ((TestNode *) obj)->names[*((int *) tc->prv)];
+    *outLen = strlen (name);
+    return (char *) name;
+}
+
+static void Test_InitEncoder(JSONObjectEncoder *enc)
+{
+    memset (enc, 0, sizeof (JSONObjectEncoder));
+    enc->beginTypeContext = Test_beginTypeContext;
+    enc->endTypeContext = Test_endTypeContext;
+    enc->getStringValue = Test_getStringValue;
+    enc->getLongValue = Test_getLongValue;
+    enc->getIntValue = Test_getIntValue;
+    enc->getDoubleValue = Test_getDoubleValue;
+    enc->iterBegin = Test_iterBegin;
+    enc->iterNext = Test_iterNext;
+    enc->iterEnd = Test_iterEnd;
+    enc->iterGetValue = Test_iterGetValue;
+    enc->iterGetName = Test_iterGetName;
+    enc->doublePrecision = 10;
+    enc->forceASCII = 1;
+}
+
+static void Test_MakeContainer(TestNode *node, int type, int count)
+{
+    memset (node, 0, sizeof (TestNode));
+    node->type = type;
+    node->count = count;
+    node->items = (TestNode *) calloc (count + 1, sizeof (TestNode));
+    node->names = (const char **) calloc (count + 1, sizeof (const char *));
+}
+
+/*
+Builds a value depth levels deep, scalars at the bottom vary with seed */
+static void Test_MakeNode(TestNode *node, int depth, int seed)
+{
+    int index;
+
+    if (depth == 0)
+    {
+        memset (node, 0, sizeof (TestNode));
+
+        switch (seed % 5)
+        {
+            case 0: node->type = JT_LONG; node->longValue = seed * 7919LL - 5; break;
+            case 1: node->type = JT_DOUBLE; node->doubleValue = seed * 0.25; break;
+            case 2: node->type = JT_UTF8; node->stringValue = "he\"llo/\xc3\xa5\n"; break;
+            case 3: node->type = JT_NULL; break;
+            default: node->type = (seed & 8) ? JT_TRUE : JT_FALSE; break;
+        }
+        return;
+    }
+
+    Test_MakeContainer (node, (depth % 2) ? JT_OBJECT : JT_ARRAY, 4);
+
+    for (index = 0; index < node->count; index ++)
+    {
+        Test_MakeNode (&node->items[index], depth - 1, seed * 4 + index);
+        node->names[index] = g_names[(seed + index) % 8];
+    }
+}
+
+static void Test_FreeNode(TestNode *node)
+{
+    int index;
+
+    for (index = 0; index < node->count; index ++)
+    {
+        Test_FreeNode (&node->items[index]);
+    }
+
+    free (node->items);
+    free (node->names);
+}
+
+/*
+Every block is filled with a pattern of its owner and checked before it is resized or freed, a
+block handed to two threads at once or recycled while still in use shows up as a mismatch */
+#define POOL_THREADS 8
+#define POOL_ITERATIONS 3000
+#define POOL_HELD 4
+
+static const size_t g_poolSizes[] = { 100, 4095, 4096, 8192, 8193, 30000, 65536, 200000, 300000, 1000000, 4194304, 4194305 };
+
+static void Pool_Fill(unsigned char *block, size_t from, size_t to, unsigned char tag)
+{
+    memset (block + from, tag, to - from);
+}
+
+static int Pool_Verify(const unsigned char *block, size_t size, unsigned char tag)
+{
+    size_t index;
+
+    for (index = 0; index < size; index += 61)
+    {
+        if (block[index] != tag)
+        {
+            return 0;
+        }
+    }
+
+    return size == 0 || block[size - 1] == tag;
+}
+
+static void *Pool_Worker(void *arg)
+{
+    unsigned int seed = (unsigned int) (size_t) arg * 2654435761U + 1;
+    unsigned char *blocks[POOL_HELD];
+    size_t sizes[POOL_HELD];
+    unsigned char tags[POOL_HELD];
+    unsigned char *resized;
+    size_t newSize;
+    int iteration;
+    int slot;
+
+    memset (blocks, 0, sizeof (blocks));
+
+    for (iteration = 0; iteration < POOL_ITERATIONS; iteration ++)
+    {
+        seed = seed * 1103515245U + 12345U;
+        slot = (seed >> 8) % POOL_HELD;
+
+        if (blocks[slot])
+        {
+            CHECK(Pool_Verify (blocks[slot], sizes[slot], tags[slot]));
+
+            if (((seed >> 16) & 1) && sizes[slot] < 1000000)
+            {
+                newSize = sizes[slot] + g_poolSizes[(seed >> 4) % (sizeof (g_poolSizes) / sizeof (size_t))];
+                resized = (unsigned char *) JSON_PoolRealloc (blocks[slot], newSize);
+                CHECK(resized != NULL);
+                if (resized)
+                {
+                    CHECK(Pool_Verify (resized, sizes[slot], tags[slot]));
+                    Pool_Fill (resized, sizes[slot], newSize, tags[slot]);
+                    blocks[slot] = resized;
+                    sizes[slot] = newSize;
+                }
+                continue;
+            }
+
+            JSON_PoolFree (blocks[slot]);
+            blocks[slot] = NULL;
+            continue;
+        }
+
+        sizes[slot] = g_poolSizes[(seed >> 4) % (sizeof (g_poolSizes) / sizeof (size_t))];
+        tags[slot] = (unsigned char) (((size_t) arg << 4) + (iteration & 15));
+        blocks[slot] = (unsigned char *) JSON_PoolMalloc (sizes[slot]);
+        CHECK(blocks[slot] != NULL);
+        if (blocks[slot])
+        {
+            Pool_Fill (blocks[slot], 0, sizes[slot], tags[slot]);
+        }
+    }
+
+    for (slot = 0; slot < POOL_HELD; slot ++)
+    {
+        JSON_PoolFree (blocks[slot]);
+    }
+
+    /*
+    Threads that trim while others allocate mustn't take blocks in use */
+    if ((size_t) arg % 3 == 0)
+    {
+        JSON_PoolTrim ();
+    }
+
+    return NULL;
+}
+
+static void Test_PoolConcurrent(void)
+{
+    pthread_t threads[POOL_THREADS];
+    int index;
+
+    for (index = 0; index < POOL_THREADS; index ++)
+    {
+        CHECK(pthread_create (&threads[index], NULL, Pool_Worker, (void *) (size_t) index) == 0);
+    }
+
+    for (index = 0; index < POOL_THREADS; index ++)
+    {
+        pthread_join (threads[index], NULL);
+    }
+
+    JSON_PoolTrim ();
+}
+
+static void *Pool_CacheAndExit(void *arg)
+{
+    void **block = (void **) arg;
+
+    *block = JSON_PoolMalloc (8192);
+    JSON_PoolFree (*block);
+    return NULL;
+}
+
+/*
+A block a thread keeps in its cache must reach the shared slots when the thread exits */
+static void Test_PoolThreadExit(void)
+{
+    pthread_t thread;
+    void *block = NULL;
+    void *reused;
+
+    JSON_PoolTrim ();
+
+    CHECK(pthread_create (&thread, NULL, Pool_CacheAndExit, &block) == 0);
+    pthread_join (thread, NULL);
+
+    reused = JSON_PoolMalloc (8192);
+    CHECK(reused == block);
+    JSON_PoolFree (reused);
+
+    /*
+    Trimming empties the calling thread's cache too, the next block comes from a different thread's exit */
+    JSON_PoolTrim ();
+    CHECK(pthread_create (&thread, NULL, Pool_CacheAndExit, &block) == 0);
+    pthread_join (thread, NULL);
+
+    reused = JSON_PoolMalloc (5000);
+    CHECK(reused == block);
+    JSON_PoolFree (reused);
+    JSON_PoolTrim ();
+}
+
+static void Test_PoolRealloc(void)
+{
+    unsigned char *block = (unsigned char *) JSON_PoolRealloc (NULL, 10000);
+    unsigned char *grown;
+
+    CHECK(block != NULL);
+    Pool_Fill (block, 0, 10000, 0x5a);
+
+    /*
+    Staying within the size class keeps the block */
+    CHECK(JSON_PoolRealloc (block, 16384) == block);
+
+    grown = (unsigned char *) JSON_PoolRealloc (block, 5000000);
+    CHECK(grown != NULL);
+    CHECK(Pool_Verify (grown, 10000, 0x5a));
+    JSON_PoolFree (grown);
+    JSON_PoolFree (NULL);
+    JSON_PoolTrim ();
+}
+
+/*
+JSON_EncodeObjectParallel must give the same bytes as JSON_EncodeObject for any thread count */
+static void Test_ParallelMatchesSerial(void)
+{
+    static const int counts[] = { 0, 1, 63, 64, 65, 1000, 20000 };
+    JSONObjectEncoder enc;
+    TestNode root;
+    char *expected;
+    char *output;
+    char small[64];
+    int type;
+    int count;
+    int index;
+    int threads;
+
+    Test_InitEncoder (&enc);
+
+    for (type = 0; type < 2; type ++)
+    {
+        for (count = 0; count < (int) (sizeof (counts) / sizeof (int)); count ++)
+        {
+            Test_MakeContainer (&root, type ? JT_OBJECT : JT_ARRAY, counts[count]);
+
+            for (index = 0; index < root.count; index ++)
+            {
+                Test_MakeNode (&root.items[index], index % 4, index);
+                root.names[index] = g_names[index % 8];
+            }
+
+            expected = JSON_EncodeObject (&root, &enc, NULL, 0);
+            CHECK(expected != NULL);
+
+            for (threads = 0; threads <= 9 && expected; threads ++)
+            {
+                output = JSON_EncodeObjectParallel (&root, &enc, threads, small, sizeof (small));
+                CHECK(output != NULL && strcmp (output, expected) == 0);
+                if (output && output != small)
+                {
+                    free (output);
+                }
+            }
+
+            /*
+            With the pool as allocator the workers' buffers are recycled across threads */
+            enc.malloc = JSON_PoolMalloc;
+            enc.realloc = JSON_PoolRealloc;
+            enc.free = JSON_PoolFree;
+            output = JSON_EncodeObjectParallel (&root, &enc, 4, NULL, 0);
+            CHECK(output != NULL && expected && strcmp (output, expected) == 0);
+            JSON_PoolFree (output);
+            enc.malloc = NULL;
+            enc.realloc = NULL;
+            enc.free = NULL;
+
+            free (expected);
+            Test_FreeNode (&root);
+        }
+    }
+
+    JSON_PoolTrim ();
+}
+
+static void Test_ParallelErrors(void)
+{
+    JSONObjectEncoder enc;
+    TestNode root;
+    TestNode deep;
+    char *expected;
+    char *output;
+    int index;
+
+    Test_InitEncoder (&enc);
+
+    /*
+    An error in any range fails the whole encode */
+    Test_MakeContainer (&root, JT_ARRAY, 10000);
+    for (index = 0; index < root.count; index ++)
+    {
+        root.items[index].type = JT_DOUBLE;
+        root.items[index].doubleValue = index;
+    }
+    root.items[7777].doubleValue = HUGE_VAL;
+
+    output = JSON_EncodeObjectParallel (&root, &enc, 8, NULL, 0);
+    CHECK(output == NULL);
+    CHECK(enc.errorMsg != NULL && strstr (enc.errorMsg, "Inf") != NULL);
+    Test_FreeNode (&root);
+
+    /*
+    The items count against recursionMax from one level down, as they do in JSON_EncodeObject */
+    enc.recursionMax = 8;
+
+    for (index = 7; index <= 10; index ++)
+    {
+        Test_MakeContainer (&root, JT_ARRAY, 200);
+        Test_MakeNode (&deep, index - 1, 3);
+        root.items[150] = deep;
+
+        expected = JSON_EncodeObject (&root, &enc, NULL, 0);
+        CHECK((expected != NULL) == (index <= 8));
+
+        output = JSON_EncodeObjectParallel (&root, &enc, 4, NULL, 0);
+        CHECK((output != NULL) == (expected != NULL));
+        CHECK(output == NULL || strcmp (output, expected) == 0);
+        free (expected);
+        free (output);
+
+        Test_FreeNode (&root);
+    }
+}
+
+/*
+A top level value that isn't a container is begun and ended exactly once */
+static void Test_ParallelScalar(void)
+{
+    JSONObjectEncoder enc;
+    TestNode node;
+    char *output;
+
+    Test_InitEncoder (&enc);
+    enc.beginTypeContext = Test_beginTypeContextCounted;
+    enc.endTypeContext = Test_endTypeContextCounted;
+
+    Test_MakeNode (&node, 0, 2);
+    g_begun = g_ended = 0;
+    output = JSON_EncodeObjectParallel (&node, &enc, 4, NULL, 0);
+    CHECK(output != NULL && strcmp (output, "\"he\\\"llo\\/\\u00e5\\n\"") == 0);
+    CHECK(g_begun == 1 && g_ended == 1);
+    free (output);
+
+    Test_MakeNode (&node, 0, 0);
+    g_begun = g_ended = 0;
+    output = JSON_EncodeObjectParallel (&node, &enc, 4, NULL, 0);
+    CHECK(output != NULL && strcmp (output, "-5") == 0);
+    CHECK(g_begun == 1 && g_ended == 1);
+    free (output);
+
+    node.type = JT_DOUBLE;
+    node.doubleValue = HUGE_VAL;
+    g_begun = g_ended = 0;
+    output = JSON_EncodeObjectParallel (&node, &enc, 4, NULL, 0);
+    CHECK(output == NULL && enc.errorMsg != NULL);
+    CHECK(g_begun == 1 && g_ended == 1);
+}
+
+int main(void)
+{
+    Test_PoolRealloc ();
+    Test_PoolThreadExit ();
+    Test_PoolConcurrent ();
+    Test_ParallelMatchesSerial ();
+    Test_ParallelErrors ();
+    Test_ParallelScalar ();
+
+    if (g_failures)
+    {
+        fprintf (stderr, "%d checks failed\n", g_failures);
+        return 1;
+    }
+
+    printf ("OK\n");
+    return 0;
+}
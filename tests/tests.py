@@ -62,6 +62,42 @@ class UltraJSONTests(TestCase):
         output = ujson.encode(input)
         self.assertEquals(output, "1.0")
 
+    def test_encodeDecimalType(self):
+        from decimal import Decimal
+        input = [Decimal("1.50"), Decimal("-12.345"), Decimal("0.00"), Decimal("-0.05"), Decimal("1E+3"), Decimal("123456789012345678")]
+        self.assertEquals(ujson.encode(input), "[1.50,-12.345,0.00,-0.05,1E+3,123456789012345678]")
+        self.assertEquals(ujson.encode(input, canonical=True), "[1.5,-12.345,0,-0.05,1000,123456789012345678]")
+        self.assertEquals(ujson.encode({"amount": Decimal("0.000001")}), '{"amount":0.000001}')
+
+        # Too many digits for the fast path or a negative zero, still exact
+        self.assertEquals(ujson.encode([Decimal("-0.00"), Decimal("-0E+3"), Decimal("-0")]), "[-0.00,-0E+3,-0]")
+        self.assertEquals(ujson.encode([Decimal("-0.00"), Decimal("-0E+3")], canonical=True), "[0,0]")
+
+        # Canonical output is the same whichever path a decimal takes
+        self.assertEquals(ujson.encode([Decimal("1.0"), Decimal("1.000000000000000000000")], canonical=True), "[1,1]")
+        self.assertEquals(ujson.encode([Decimal("1E+400"), Decimal("10E+399"), Decimal("1000E+307"), Decimal("1E+310")], canonical=True), "[1e+400,1e+400,1e+310,1e+310]")
+        self.assertEquals(ujson.encode([Decimal("-1.50E-400"), Decimal("-0E+500"), Decimal("0E-500"), Decimal("12E+309"), Decimal("1200E+307")], canonical=True), "[-1.5e-400,0,0,1.2e+310,1.2e+310]")
+        self.assertEquals(ujson.encode([Decimal("1E+308"), Decimal("10000000000000000000000E+286"), Decimal("12E+307")], canonical=True), "[1%s,1%s,12%s]" % ("0" * 308, "0" * 308, "0" * 307))
+        self.assertEquals(ujson.encode([Decimal("123456789012345678901234.5000"), Decimal("-0.00001234567890123456789000")], canonical=True), "[123456789012345678901234.5,-0.00001234567890123456789]")
+        for value in ["12345678901234567890.123", "1E-400", "-1E+400"]:
+            self.assertEquals(Decimal(ujson.encode(Decimal(value))), Decimal(value))
+
+        self.assertRaises(OverflowError, ujson.encode, Decimal("NaN"))
+        self.assertRaises(OverflowError, ujson.encode, Decimal("-Infinity"))
+
+        class SubDecimal(Decimal):
+            pass
+        self.assertEquals(ujson.encode([SubDecimal("9.99")]), "[9.99]")
+
+        # The number is written as Decimal formats it, whatever a subclass's __str__ returns
+        class PriceDecimal(Decimal):
+            def __str__(self):
+                return "$" + Decimal.__str__(self)
+            def is_finite(self):
+                return False
+        input = [PriceDecimal("1.5"), PriceDecimal("1" * 30), PriceDecimal("-1E+400"), PriceDecimal("-0")]
+        self.assertEquals(ujson.encode(input), "[1.5,%s,-1E+400,-0]" % ("1" * 30))
+
     def test_encodeDoubleNegConversion(self):
         input = -math.pi
         output = ujson.encode(input)
@@ -97,6 +133,22 @@ class UltraJSONTests(TestCase):
         self.assertEquals(round(input, 3), json.loads(output))
         self.assertEquals(round(input, 3), ujson.decode(output))
 
+    def test_doubleShortestRoundTrip(self):
+        for input in [0.1, 1.0 / 3, -math.pi, 5e-324, 1.7976931348623157e308, 123456789.123456789, 1e-7, 31337.31337]:
+            output = ujson.encode(input, double_shortest=True)
+            self.assertEquals(input, float(output))
+            self.assertEquals(input, json.loads(output))
+        self.assertEquals(ujson.encode(0.1, double_shortest=True), "0.1")
+        self.assertEquals(ujson.encode(1.0, double_shortest=True), "1.0")
+        self.assertEquals(ujson.encode(-0.0, double_shortest=True), "-0.0")
+        self.assertEquals(ujson.encode(1e300, double_shortest=True), "1e+300")
+
+    def test_encodeBigDoubleExponent(self):
+        for input in [1.5e17, -2.5e100, 1.7976931348623157e308]:
+            output = ujson.encode(input)
+            self.assertEquals(input, json.loads(output))
+        self.assertEquals(ujson.encode(1.5e17), "1.5e+17")
+
     def test_invalidDoublePrecision(self):
         input = 30.12345678901234567890
         output = ujson.encode(input, double_precision = 20)
@@ -140,6 +192,104 @@ class UltraJSONTests(TestCase):
         self.assertEquals(input, dec)
         self.assertEquals(enc, json_unicode(input))
 
+    def test_encodeLongStringEscaping(self):
+        for pos in xrange(0, 70):
+            input = "x" * pos + "\"\\/\n\x01" + "y" * (70 - pos)
+            enc = ujson.encode(input, ensure_ascii=False)
+            self.assertEquals(input, ujson.decode(enc))
+            self.assertEquals(enc, json.dumps(input).replace("/", "\\/"))
+
+    def test_encodeLongStringEnsureAscii(self):
+        for pos in xrange(0, 70):
+            input = u"x" * pos + u"\xe5日本\U00010346\"" + u"y" * (70 - pos)
+            enc = ujson.encode(input)
+            self.assertEquals(input, ujson.decode(enc))
+            self.assertEquals(enc, json.dumps(input).replace("/", "\\/"))
+
+    def test_encodeInvalidUTF8EnsureAscii(self):
+        for input in ["\x80", "abc\xbf", "\xff", "\xc3", "\xe6\x97", "\xc3A", "\xe6\x97A", "x" * 40 + "\xf0\x90(\x86"]:
+            self.assertRaises(OverflowError, ujson.encode, input)
+
+    def test_encodeManyControlCharacters(self):
+        input = "\x01" * 100000
+        enc = ujson.encode(input)
+        self.assertEquals(input, ujson.decode(enc))
+        self.assertEquals(len(enc), 600002)
+
+    def test_encodeLargeStrings(self):
+        clean = "0123456789abcdef" * 1024
+        input = [clean, {u"a": clean, u"b": [clean, 1]}, clean + "/", u"\xe5" + clean, "\xc3\xa5" + clean, clean[:100]]
+        refcount = sys.getrefcount(clean)
+        for ensure_ascii in (True, False):
+            output = ujson.encode(input, ensure_ascii=ensure_ascii)
+            self.assertEquals(json.loads(output), input[:4] + [u"\xe5" + clean] + input[5:])
+        self.assertEquals(sys.getrefcount(clean), refcount)
+        self.assertEquals(ujson.encode(clean), '"' + clean + '"')
+
+    def test_encodeMemoize(self):
+        user = {u"name": u"J\xf6rg", u"tags": [u"a/b", 1.5, None], u"nested": {u"x": [1, 2, 3]}}
+        shared = [1, 2, [3, 4]]
+        input = {u"friends": [user] * 8, u"lists": (shared, shared, [shared] * 3), u"other": [dict(user), list(shared)]}
+        for ensure_ascii in (True, False):
+            output = ujson.encode(input, memoize=True, ensure_ascii=ensure_ascii, sort_keys=True)
+            self.assertEquals(output, ujson.encode(input, ensure_ascii=ensure_ascii, sort_keys=True))
+
+        large = [{u"text": u"x" * 10000, u"id": i} for i in range(100)]
+        input = [large[i % 7] for i in range(1000)] + [large]
+        self.assertEquals(json.loads(ujson.encode(input, memoize=True)), input)
+
+        f = StringIO.StringIO()
+        ujson.dump(input, f, memoize=True)
+        self.assertEquals(json.loads(f.getvalue()), input)
+
+        refcount = sys.getrefcount(user)
+        ujson.encode([user] * 100, memoize=True)
+        self.assertEquals(sys.getrefcount(user), refcount)
+        self.assertRaises(OverflowError, ujson.encode, [user, [user, float("inf")]], memoize=True)
+        self.assertEquals(sys.getrefcount(user), refcount)
+
+        # Containers referenced once are not memoized, with sort_keys as without
+        class Probe(object):
+            def __json__(self):
+                refcounts.append(sys.getrefcount(input[u"a"]))
+                return "0"
+        input = {u"a": [1, 2], u"b": Probe()}
+        refcount = sys.getrefcount(input[u"a"])
+        for sort_keys in (True, False):
+            refcounts = []
+            self.assertEquals(json.loads(ujson.encode(input, memoize=True, sort_keys=sort_keys)), {u"a": [1, 2], u"b": 0})
+            self.assertEquals(refcounts, [refcount])
+
+    def test_encodeLargeDocument(self):
+        input = [{u"id": i, u"text": u"a/b" * (i % 3000), u"raw": "x" * (i % 5000)} for i in range(3000)]
+        output = ujson.encode(input)
+        self.assertEquals(json.loads(output), input)
+        f = StringIO.StringIO()
+        ujson.dump(input, f)
+        self.assertEquals(output, f.getvalue())
+
+    def test_encodeHugeStrings(self):
+        for pad in range(4):
+            input = u"x" * (65536 - pad) + u"\U0001f600\u65e5\xe5/" * 50000
+            for ensure_ascii in (True, False):
+                self.assertEquals(json.loads(ujson.encode(input, ensure_ascii=ensure_ascii)), input)
+
+        chunks = []
+        input = [u"\n" * 500000, u"\u65e5" * 100000]
+        class writer:
+            def write(self, chunk):
+                chunks.append(chunk)
+        ujson.dump(input, writer())
+        self.assertEquals(json.loads("".join(chunks)), input)
+        self.assertTrue(max(len(chunk) for chunk in chunks) < 1000000)
+
+    def test_encodeRepeatedKeys(self):
+        keys = [u'\u65e5', u'a"b', u'c\\d', u'\x01', u'x' * 40] + [u'key%d' % i for i in range(200)]
+        input = [dict((k, i) for k in keys[i % 50:i % 50 + 100]) for i in range(100)]
+        for ensure_ascii in (True, False):
+            output = ujson.encode(input, ensure_ascii=ensure_ascii)
+            self.assertEquals(input, json.loads(output))
+
 
     def test_encodeUnicodeConversion2(self):
         input = "\xe6\x97\xa5\xd1\x88"
@@ -285,6 +435,30 @@ class UltraJSONTests(TestCase):
         dec2 = ujson.decode(str(input))
         self.assertEquals(dec1, dec2)
 
+    def test_encodeDeepNesting(self):
+        for depth in (31, 32, 33, 100, 1024):
+            input = []
+            for i in range(depth):
+                input = [input] if i % 2 else {u"k": input}
+            output = ujson.encode(input)
+            self.assertEquals(output.count("["), depth // 2 + 1)
+            self.assertEquals(output.count("{"), (depth + 1) // 2)
+
+        input = []
+        for i in range(1025):
+            input = [input]
+        self.assertRaises(OverflowError, ujson.encode, input)
+
+        # A memoized container that fits where it's first encoded must not be reused deeper down
+        sub = []
+        for i in range(1000):
+            sub = [sub]
+        deeper = sub
+        for i in range(60):
+            deeper = [deeper]
+        self.assertRaises(OverflowError, ujson.encode, [[sub], deeper], memoize=True)
+        self.assertEquals(ujson.encode([[sub], [sub]], memoize=True), ujson.encode([[sub], [sub]]))
+
     def test_encodeRecursionMax(self):
         # 8 is the max recursion depth
 
@@ -551,6 +725,14 @@ class UltraJSONTests(TestCase):
         self.assertEquals(input, ujson.decode(output))
         pass
 
+    def test_encodeIntegerDigitBoundaries(self):
+        input = [-9223372036854775808, 9223372036854775807, -2147483648, 4294967296]
+        for digits in xrange(1, 19):
+            input.extend([10 ** digits - 1, 10 ** digits, -(10 ** digits)])
+        output = ujson.encode(input)
+        self.assertEquals(output, json.dumps(input).replace(" ", ""))
+        self.assertEquals(input, ujson.decode(output))
+
     def test_numericIntExp(self):
         input = "1337E40"
         output = ujson.decode(input)
@@ -606,6 +788,123 @@ class UltraJSONTests(TestCase):
         ujson.dump([1, 2, 3], f)
         self.assertEquals("[1,2,3]", f.bytes)
 
+    def test_dumpLargeStreamsInChunks(self):
+        class filelike:
+            def __init__(self):
+                self.chunks = []
+            def write(self, bytes):
+                self.chunks.append(bytes)
+        input = [{'a': 'x' * 100, 'b': i} for i in range(10000)]
+        f = filelike()
+        ujson.dump(input, f)
+        self.assertTrue(len(f.chunks) > 1)
+        self.assertEquals(ujson.encode(input), ''.join(f.chunks))
+
+    def test_dumpWriteError(self):
+        class filelike:
+            def write(self, bytes):
+                raise IOError('write failed')
+        input = [{'a': 'x' * 100, 'b': i} for i in range(100000)]
+        self.assertRaises(IOError, ujson.dump, input, filelike())
+
+    def test_encodeNumericArrays(self):
+        floats = [i * 1.5 - 300.25 for i in range(1000)]
+        ints = [i * 7919 - 10 ** 6 for i in range(1000)] + [2 ** 63 - 1, -2 ** 63]
+        self.assertEquals(floats, json.loads(ujson.encode(floats)))
+        self.assertEquals(ints, json.loads(ujson.encode(ints)))
+        self.assertEquals(ujson.encode(tuple(ints)), ujson.encode(ints))
+        self.assertEquals(ujson.encode(floats, double_shortest=True), "[" + ",".join(repr(f) for f in floats) + "]")
+
+        # Mixed or non exact types are encoded element by element
+        self.assertEquals(json.loads(ujson.encode(ints + floats + [True])), ints + floats + [True])
+        self.assertEquals(json.loads(ujson.encode(floats + [1])), floats + [1])
+        self.assertRaises(OverflowError, ujson.encode, ints + [2 ** 64])
+        self.assertRaises(OverflowError, ujson.encode, floats + [float("nan")])
+
+    def test_encodeBatch(self):
+        input = [{u"id": i, u"name": u"n\xe5me"} for i in range(1000)] + [[1, 2.5, None], u"str", 31337]
+        output = ujson.encode_batch(input, ensure_ascii=False)
+        self.assertEquals(output, [ujson.encode(obj, ensure_ascii=False) for obj in input])
+
+        output = ujson.encode_batch(input, separator="\n")
+        self.assertEquals(output, "".join(ujson.encode(obj) + "\n" for obj in input))
+        self.assertEquals([json.loads(line) for line in output.splitlines()], input)
+
+        self.assertEquals(ujson.encode_batch([]), [])
+        self.assertEquals(ujson.encode_batch((1, 2), separator=u", "), "1, 2, ")
+        self.assertRaises(TypeError, ujson.encode_batch, 31337)
+        self.assertRaises(OverflowError, ujson.encode_batch, [1, 2 ** 64])
+
+    def test_encodeHashed(self):
+        class RawTest:
+            def __init__(self, raw):
+                self.raw = raw
+            def __json__(self):
+                return self.raw
+
+        self.assertEquals(ujson.encode_hashed(RawTest("Nobody inspects the spammish repetition")), ("Nobody inspects the spammish repetition", 0xfbcea83c8a378bf1))
+        self.assertEquals(ujson.encode_hashed(RawTest("abc")), ("abc", 0x44bc2cf5ad770999))
+
+        input = [{u"id": i, u"text": u"a/b\xe5" * (i % 300), u"clean": "x" * (i % 9000)} for i in range(2000)]
+        output, digest = ujson.encode_hashed(input, ensure_ascii=False)
+        self.assertEquals(output, ujson.encode(input, ensure_ascii=False))
+        self.assertEquals(ujson.encode_hashed(RawTest(output)), (output, digest))
+        self.assertEquals(ujson.encode_hashed(input, ensure_ascii=False, memoize=True, seed=0)[1], digest)
+        self.assertNotEquals(ujson.encode_hashed(input, ensure_ascii=False, seed=1)[1], digest)
+        self.assertRaises(OverflowError, ujson.encode_hashed, [], seed=-1)
+
+    def test_encodeTemplate(self):
+        template = ujson.Template('{"status":"ok","id":<int>,"items":<raw>,"ts":<double>,"msg":<str>,"v":<value>,"lit":"<int>\\""}')
+        self.assertEquals(template.holes, 5)
+        output = template(5, "[1,2]", 1.5, u"a\xe5/", {u"a": [1, None]})
+        self.assertEquals(output, '{"status":"ok","id":5,"items":[1,2],"ts":1.5,"msg":"a\\u00e5\\/","v":{"a":[1,null]},"lit":"<int>\\""}')
+        self.assertEquals(template.encode(-1, "null", 0.25, "", 3), '{"status":"ok","id":-1,"items":null,"ts":0.25,"msg":"","v":3,"lit":"<int>\\""}')
+
+        large = [u"x" * 100000, range(20000)]
+        self.assertEquals(ujson.Template("[<str>,<value>]")(*large), ujson.encode(large))
+        self.assertEquals(ujson.Template("[<str>]", ensure_ascii=False)(u"\xe5"), ujson.encode([u"\xe5"], ensure_ascii=False))
+        self.assertEquals(ujson.Template("[]")(), "[]")
+
+        self.assertRaises(TypeError, template, 1)
+        self.assertRaises(TypeError, template, "1", "[]", 1.0, "", 1)
+        self.assertRaises(OverflowError, template, 1, "[]", float("inf"), "", 1)
+        self.assertRaises(ValueError, ujson.Template, "[<float>]")
+        self.assertRaises(ValueError, ujson.Template, '["abc]')
+
+    def test_encodeGzip(self):
+        if not hasattr(ujson, "encode_gzip"):
+            return
+        import zlib
+        input = [{u"a": u"x" * 100, u"b": i, u"c": 1.5} for i in range(10000)]
+        output = ujson.encode_gzip(input)
+        self.assertTrue(len(output) < len(ujson.encode(input)) // 10)
+        self.assertEquals(zlib.decompress(output, 31), ujson.encode(input))
+        self.assertEquals(zlib.decompress(ujson.encode_gzip([1, 2], level=1, double_precision=3), 31), "[1,2]")
+        self.assertRaises(ValueError, ujson.encode_gzip, [], level=10)
+        self.assertRaises(OverflowError, ujson.encode_gzip, [float("inf")])
+
+    def test_encodeSortKeys(self):
+        input = {u"b": 1, u"a": {u"z": [1, 2], u"\xe5": None, u"y": u"x"}, u"aa": True, u"B": 2.5, 3: u"three"}
+        output = ujson.encode(input, sort_keys=True)
+        self.assertEquals(output, '{"3":"three","B":2.5,"a":{"y":"x","z":[1,2],"\\u00e5":null},"aa":true,"b":1}')
+        self.assertEquals(json.loads(output), json.loads(ujson.encode(input)))
+
+        large = dict((u"k%d" % i, i) for i in range(1000))
+        self.assertEquals(ujson.encode(large, sort_keys=True), json.dumps(large, sort_keys=True, separators=(",", ":")))
+        self.assertEquals(ujson.encode({}, sort_keys=True), "{}")
+
+    def test_encodeCanonical(self):
+        self.assertEquals(ujson.encode([1.0, -0.0, 0.0, 2.5, 1e15, 1e16, 1e300, 0.1], canonical=True), "[1,0,0,2.5,1000000000000000,1e+16,1e+300,0.1]")
+        a = {u"x": 1, u"y": [2.0, {u"q": 0.30000000000000004, u"p": -3}]}
+        b = {u"y": [2, {u"p": -3.0, u"q": 0.30000000000000004}], u"x": 1.0}
+        self.assertEquals(ujson.encode(a, canonical=True), ujson.encode(b, canonical=True))
+        self.assertEquals(ujson.encode(a, canonical=True), '{"x":1,"y":[2,{"p":-3,"q":%s}]}' % ujson.encode(0.30000000000000004, double_shortest=True))
+        self.assertRaises(OverflowError, ujson.encode, [float("nan")], canonical=True)
+        self.assertRaises(ValueError, ujson.encode, {1: "a", "1": "b"}, canonical=True)
+        self.assertRaises(ValueError, ujson.encode, {"1": "b", 1: "a"}, canonical=True)
+        self.assertRaises(ValueError, ujson.encode, [{u"x": {2: 0, u"2": 1}}], canonical=True)
+        self.assertEquals(ujson.encode({2: "b", u"1": "a"}, canonical=True), '{"1":"a","2":"b"}')
+
     def test_dumpFileArgsError(self):
         try:
             ujson.dump([], '')
@@ -710,6 +1009,23 @@ class UltraJSONTests(TestCase):
         dec = ujson.decode(output)
         self.assertEquals(dec, d)
 
+    def test_rawJSON(self):
+        class RawTest:
+            def __init__(self, raw):
+                self.raw = raw
+            def __json__(self):
+                return self.raw
+
+        output = ujson.encode({u"a": RawTest('{"cached": [1, 2.5, "\\u00e5"]}'), u"b": [RawTest(u"31337")]})
+        self.assertEquals(ujson.decode(output), {u"a": {u"cached": [1, 2.5, u"\xe5"]}, u"b": [31337]})
+        self.assertEquals(ujson.encode(RawTest('"x"')), '"x"')
+        self.assertRaises(TypeError, ujson.encode, RawTest(None))
+
+        class RawFail:
+            def __json__(self):
+                raise ValueError("no json")
+        self.assertRaises(ValueError, ujson.encode, [RawFail()])
+
     def test_decodeArrayTrailingCommaFail(self):
         input = "[31337,]"
         try: